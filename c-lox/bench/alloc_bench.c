@@ -0,0 +1,96 @@
+// Allocation microbenchmark for the pooled allocator.  It mimics the churn of binary_trees.lox:
+// lots of small, same-sized headers plus short string buffers that are built and dropped in
+// waves.  Each workload runs once through the pool and once through plain realloc/free.
+#include "../src/pool_allocator.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+typedef struct node {
+    struct node* left;
+    struct node* right;
+    char* label;
+    int label_length;
+} node;
+
+typedef void* (*allocator_fn)(void* pointer, size_t old_size, size_t new_size);
+
+static void* system_allocator(void* pointer, size_t old_size, size_t new_size) {
+    if (new_size == 0) {
+        free(pointer);
+        return NULL;
+    }
+
+    void* result = realloc(pointer, new_size);
+    if (result == NULL) {
+        exit(EXIT_FAILURE);
+    }
+    return result;
+}
+
+static node* bottom_up_tree(allocator_fn alloc, int depth) {
+    node* n = (node*)alloc(NULL, 0, sizeof(node));
+    n->label_length = 8 + depth;
+    n->label = (char*)alloc(NULL, 0, (size_t)n->label_length + 1);
+    memset(n->label, 'a' + depth, (size_t)n->label_length);
+    n->label[n->label_length] = '\0';
+
+    if (depth > 0) {
+        n->left = bottom_up_tree(alloc, depth - 1);
+        n->right = bottom_up_tree(alloc, depth - 1);
+    } else {
+        n->left = NULL;
+        n->right = NULL;
+    }
+    return n;
+}
+
+static int check_tree(node* n) {
+    if (n->left == NULL) {
+        return 1;
+    }
+    return 1 + check_tree(n->left) + check_tree(n->right);
+}
+
+static void free_tree(allocator_fn alloc, node* n) {
+    if (n->left != NULL) {
+        free_tree(alloc, n->left);
+        free_tree(alloc, n->right);
+    }
+    alloc(n->label, (size_t)n->label_length + 1, 0);
+    alloc(n, sizeof(node), 0);
+}
+
+static double run(allocator_fn alloc, int max_depth, long* checksum) {
+    clock_t start = clock();
+
+    node* long_lived = bottom_up_tree(alloc, max_depth);
+    for (int depth = 4; depth <= max_depth; depth += 2) {
+        int iterations = 1 << (max_depth - depth + 4);
+        for (int i = 0; i < iterations; ++i) {
+            node* temp = bottom_up_tree(alloc, depth);
+            *checksum += check_tree(temp);
+            free_tree(alloc, temp);
+        }
+    }
+    *checksum += check_tree(long_lived);
+    free_tree(alloc, long_lived);
+
+    return (double)(clock() - start) / CLOCKS_PER_SEC;
+}
+
+int main(int argc, char** argv) {
+    int max_depth = argc > 1 ? atoi(argv[1]) : 16;
+
+    long system_checksum = 0;
+    long pool_checksum = 0;
+    double system_time = run(system_allocator, max_depth, &system_checksum);
+    double pool_time = run(pool_reallocate, max_depth, &pool_checksum);
+    pool_release_all();
+
+    printf("depth %d\n", max_depth);
+    printf("  realloc/free: %.3fs (checksum %ld)\n", system_time, system_checksum);
+    printf("  pool:         %.3fs (checksum %ld)\n", pool_time, pool_checksum);
+    return system_checksum == pool_checksum ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -1,7 +1,10 @@
 #include "bytecode_chunk.h"
+#include "clox_object.h"
 #include "clox_value.h"
 #include "memory.h"
+#include "virtual_machine.h"
 #include <stdlib.h>
+#include <string.h>
 
 static void encode_line_run(bytecode_chunk* chunk, int line) {
     // Case 1: The line_run continues, increment the count.
@@ -30,18 +33,317 @@ void init_bytecode_chunk(bytecode_chunk* chunk) {
     chunk->lr_capacity = 0;
     chunk->line_runs = NULL;
     init_value_array(&chunk->constants);
+    chunk->ci_count = 0;
+    chunk->ci_capacity = 0;
+    chunk->constant_index = NULL;
+    chunk->st_count = 0;
+    chunk->st_capacity = 0;
+    chunk->switch_tables = NULL;
+    chunk->pc_count = 0;
+    chunk->pc_capacity = 0;
+    chunk->property_caches = NULL;
+    chunk->mc_count = 0;
+    chunk->mc_capacity = 0;
+    chunk->method_caches = NULL;
 }
 
 void free_bytecode_chunk(bytecode_chunk* chunk) {
     FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
     FREE_ARRAY(line_run, chunk->line_runs, chunk->lr_capacity);
     free_value_array(&chunk->constants);
+    FREE_ARRAY(int, chunk->constant_index, chunk->ci_capacity);
+    for (int i = 0; i < chunk->st_count; ++i) {
+        switch_table* table = &chunk->switch_tables[i];
+        if (!table->dense) {
+            FREE_ARRAY(clox_value, table->keys, table->capacity);
+        }
+        FREE_ARRAY(int, table->targets, table->capacity);
+    }
+    FREE_ARRAY(switch_table, chunk->switch_tables, chunk->st_capacity);
+    FREE_ARRAY(property_cache, chunk->property_caches, chunk->pc_capacity);
+    FREE_ARRAY(method_cache, chunk->method_caches, chunk->mc_capacity);
     init_bytecode_chunk(chunk);
 }
 
+static bool is_indexed_constant(clox_value val) { return IS_NUMBER(val) || IS_STRING(val); }
+
+static uint32_t hash_constant(clox_value val) {
+    if (IS_STRING(val)) {
+        return AS_STRING(val)->hash;
+    }
+
+    // Integral doubles have all their low mantissa bits clear, so mix every bit down before the
+    // index masks the hash.
+    double number = AS_NUMBER(val);
+    uint64_t bits;
+    memcpy(&bits, &number, sizeof(bits));
+    bits ^= bits >> 33;
+    bits *= 0xFF51AFD7ED558CCDull;
+    bits ^= bits >> 33;
+    return (uint32_t)bits;
+}
+
+// Numbers are compared bit for bit, which keeps 0 and -0 apart and lets NaN match itself.  Strings
+// are interned, so comparing the objects is enough.
+static bool same_constant(clox_value a, clox_value b) {
+    if (IS_NUMBER(a) && IS_NUMBER(b)) {
+        double x = AS_NUMBER(a);
+        double y = AS_NUMBER(b);
+        return memcmp(&x, &y, sizeof(double)) == 0;
+    }
+    return IS_STRING(a) && IS_STRING(b) && AS_STRING(a) == AS_STRING(b);
+}
+
+// Returns the index slot that holds 'val', or the empty slot where it belongs.  Slots pointing past
+// the end of the constant table were left behind by rewind_bytecode_chunk() and never match.
+static int* find_constant_slot(bytecode_chunk* chunk, clox_value val) {
+    uint32_t mask = (uint32_t)chunk->ci_capacity - 1;
+    uint32_t index = hash_constant(val) & mask;
+
+    while (true) {
+        int* slot = &chunk->constant_index[index];
+        if (*slot == 0) {
+            return slot;
+        }
+
+        int constant = *slot - 1;
+        if (constant < chunk->constants.count &&
+            same_constant(chunk->constants.values[constant], val)) {
+            return slot;
+        }
+
+        index = (index + 1) & mask;
+    }
+}
+
+// Rebuilds the index from the live constants, dropping stale entries, with room for at least one
+// more at no more than half load.
+static void rebuild_constant_index(bytecode_chunk* chunk) {
+    int old_capacity = chunk->ci_capacity;
+    int capacity = 16;
+    while (capacity < (chunk->constants.count + 1) * 2) {
+        capacity *= 2;
+    }
+
+    FREE_ARRAY(int, chunk->constant_index, old_capacity);
+    chunk->constant_index = ALLOCATE(int, capacity);
+    chunk->ci_capacity = capacity;
+    chunk->ci_count = 0;
+    memset(chunk->constant_index, 0, sizeof(int) * capacity);
+
+    for (int i = 0; i < chunk->constants.count; ++i) {
+        clox_value val = chunk->constants.values[i];
+        if (is_indexed_constant(val)) {
+            int* slot = find_constant_slot(chunk, val);
+            if (*slot == 0) {
+                *slot = i + 1;
+                ++chunk->ci_count;
+            }
+        }
+    }
+}
+
 int add_constant(bytecode_chunk* chunk, clox_value val) {
+    bool indexed = is_indexed_constant(val);
+    if (indexed && chunk->ci_capacity > 0) {
+        int* slot = find_constant_slot(chunk, val);
+        if (*slot != 0) {
+            return *slot - 1;
+        }
+    }
+
+    // Growing the constant array or its index can trigger a collection.  Until the caller has run
+    // the write barrier the constant table doesn't keep the value alive on its own, so it stays on
+    // the stack until we're done.
+    virtual_machine_stack_push(val);
     write_to_value_array(&chunk->constants, val);
-    return chunk->constants.count - 1;
+    int constant = chunk->constants.count - 1;
+
+    if (indexed) {
+        if ((chunk->ci_count + 1) * 2 > chunk->ci_capacity) {
+            rebuild_constant_index(chunk);
+        } else {
+            int* slot = find_constant_slot(chunk, val);
+            if (*slot == 0) {
+                ++chunk->ci_count;
+            }
+            *slot = constant + 1;
+        }
+    }
+
+    virtual_machine_stack_pop();
+    return constant;
+}
+
+// Adds an empty table for an OP_SWITCH whose cases haven't been compiled yet.
+int add_switch_table(bytecode_chunk* chunk) {
+    if (chunk->st_count >= chunk->st_capacity) {
+        int old = chunk->st_capacity;
+        chunk->st_capacity = GROW_CAPACITY(old);
+        chunk->switch_tables =
+            GROW_ARRAY(switch_table, chunk->switch_tables, old, chunk->st_capacity);
+    }
+
+    chunk->switch_tables[chunk->st_count] =
+        (switch_table){.dense = true, .min = 0, .capacity = 0, .keys = NULL, .targets = NULL,
+                       .miss = 0};
+    return chunk->st_count++;
+}
+
+// Adds an empty inline cache for a property access to 'name'.
+int add_property_cache(bytecode_chunk* chunk, object_string* name) {
+    if (chunk->pc_count >= chunk->pc_capacity) {
+        int old = chunk->pc_capacity;
+        chunk->pc_capacity = GROW_CAPACITY(old);
+        chunk->property_caches =
+            GROW_ARRAY(property_cache, chunk->property_caches, old, chunk->pc_capacity);
+    }
+
+    property_cache* cache = &chunk->property_caches[chunk->pc_count];
+    cache->name = name;
+    cache->count = 0;
+    for (int i = 0; i < PROPERTY_CACHE_ENTRIES; ++i) {
+        cache->entries[i] = (property_cache_entry){.shape = NULL, .transition = NULL, .slot = 0};
+    }
+    return chunk->pc_count++;
+}
+
+// Adds an empty inline cache for a call to the method 'name'.
+int add_method_cache(bytecode_chunk* chunk, object_string* name) {
+    if (chunk->mc_count >= chunk->mc_capacity) {
+        int old = chunk->mc_capacity;
+        chunk->mc_capacity = GROW_CAPACITY(old);
+        chunk->method_caches =
+            GROW_ARRAY(method_cache, chunk->method_caches, old, chunk->mc_capacity);
+    }
+
+    chunk->method_caches[chunk->mc_count] =
+        (method_cache){.name = name, .klass = NULL, .shape = NULL, .method = NULL_VALUE};
+    return chunk->mc_count++;
+}
+
+static bool is_small_integer(clox_value val) {
+    if (!IS_NUMBER(val)) {
+        return false;
+    }
+    double number = AS_NUMBER(val);
+    return number >= -1e15 && number <= 1e15 && number == (double)(int64_t)number;
+}
+
+// Labels are matched with values_equal(), so 0 and -0 have to land in the same slot.
+static uint32_t hash_switch_key(clox_value val) {
+    if (IS_NUMBER(val) && AS_NUMBER(val) == 0) {
+        val = NUMBER_VALUE(0);
+    }
+    return hash_constant(val);
+}
+
+// Fills 'table' from the cases in source order.  A label that repeats an earlier one could never
+// be reached, so only the first copy goes in.  The labels must already be constants of the chunk,
+// which is what keeps the strings among them alive.
+void build_switch_table(switch_table* table, switch_case* cases, int count, int miss) {
+    double min = 0;
+    double max = -1;
+    bool dense = count > 0;
+    for (int i = 0; i < count && dense; ++i) {
+        clox_value key = cases[i].key;
+        if (!is_small_integer(key)) {
+            dense = false;
+            break;
+        }
+        double number = AS_NUMBER(key);
+        if (i == 0 || number < min) {
+            min = number;
+        }
+        if (i == 0 || number > max) {
+            max = number;
+        }
+    }
+    if (dense && max - min + 1 > 2.0 * count) {
+        dense = false;
+    }
+
+    table->dense = dense;
+    table->miss = miss;
+
+    if (dense) {
+        table->min = min;
+        table->capacity = (int)(max - min) + 1;
+        table->keys = NULL;
+        table->targets = ALLOCATE(int, table->capacity);
+        for (int i = 0; i < table->capacity; ++i) {
+            table->targets[i] = -1;
+        }
+
+        for (int i = 0; i < count; ++i) {
+            int index = (int)(AS_NUMBER(cases[i].key) - min);
+            if (table->targets[index] < 0) {
+                table->targets[index] = cases[i].target;
+            }
+        }
+        return;
+    }
+
+    int capacity = 8;
+    while (capacity < count * 2) {
+        capacity *= 2;
+    }
+    table->min = 0;
+    table->capacity = capacity;
+    table->keys = ALLOCATE(clox_value, capacity);
+    table->targets = ALLOCATE(int, capacity);
+    for (int i = 0; i < capacity; ++i) {
+        table->keys[i] = NULL_VALUE;
+        table->targets[i] = -1;
+    }
+
+    uint32_t mask = (uint32_t)capacity - 1;
+    for (int i = 0; i < count; ++i) {
+        clox_value key = cases[i].key;
+        // NaN never equals anything, so its case can never be taken.
+        if (!values_equal(key, key)) {
+            continue;
+        }
+
+        uint32_t index = hash_switch_key(key) & mask;
+        while (table->targets[index] >= 0 && !values_equal(table->keys[index], key)) {
+            index = (index + 1) & mask;
+        }
+        if (table->targets[index] < 0) {
+            table->keys[index] = key;
+            table->targets[index] = cases[i].target;
+        }
+    }
+}
+
+// Offset of the body 'val' selects, or the miss offset when no label matches it.
+int switch_table_target(switch_table* table, clox_value val) {
+    if (table->dense) {
+        if (IS_NUMBER(val)) {
+            double index = AS_NUMBER(val) - table->min;
+            if (index >= 0 && index < table->capacity && index == (int)index) {
+                int target = table->targets[(int)index];
+                if (target >= 0) {
+                    return target;
+                }
+            }
+        }
+        return table->miss;
+    }
+
+    if (!IS_NUMBER(val) && !IS_STRING(val)) {
+        return table->miss;
+    }
+
+    uint32_t mask = (uint32_t)table->capacity - 1;
+    uint32_t index = hash_switch_key(val) & mask;
+    while (table->targets[index] >= 0) {
+        if (values_equal(table->keys[index], val)) {
+            return table->targets[index];
+        }
+        index = (index + 1) & mask;
+    }
+    return table->miss;
 }
 
 u24_t construct_u24_t(int index) {
@@ -63,6 +365,25 @@ void write_to_bytecode_chunk(bytecode_chunk* chunk, uint8_t byte, int line) {
     encode_line_run(chunk, line);
 }
 
+// Drops everything written after the first 'code_count' bytes and 'constant_count' constants,
+// trimming the line runs to match.
+void rewind_bytecode_chunk(bytecode_chunk* chunk, int code_count, int constant_count) {
+    int dropped = chunk->count - code_count;
+    while (dropped > 0) {
+        line_run* last = &chunk->line_runs[chunk->lr_count - 1];
+        if (last->count > dropped) {
+            last->count -= dropped;
+            break;
+        }
+
+        dropped -= last->count;
+        --chunk->lr_count;
+    }
+
+    chunk->count = code_count;
+    chunk->constants.count = constant_count;
+}
+
 int get_source_line(bytecode_chunk* chunk, int instr_index) {
     if (instr_index < 0 || instr_index >= chunk->count) {
         return -1;
@@ -80,3 +401,224 @@ int get_source_line(bytecode_chunk* chunk, int instr_index) {
 
     return -1;
 }
+
+// Size in bytes of an instruction including its operands.
+int opcode_length(uint8_t op) {
+    switch (op) {
+        case OP_CONSTANT:
+        case OP_GET_LOCAL:
+        case OP_SET_LOCAL:
+        case OP_GET_GLOBAL:
+        case OP_DEFINE_GLOBAL:
+        case OP_DEFINE_GLOBAL_CONST:
+        case OP_SET_GLOBAL:
+        case OP_CALL:
+        case OP_TAIL_CALL:
+        case OP_SET_LOCAL_POP:
+        case OP_SET_GLOBAL_POP:
+        case OP_GET_GLOBAL_DEFINED:
+        case OP_GET_UPVALUE:
+        case OP_SET_UPVALUE:
+        case OP_CLOSURE:
+        case OP_GET_SUPER:
+        case OP_LIST:
+        case OP_CLASS:
+        case OP_METHOD:
+            return 2;
+        case OP_JUMP:
+        case OP_JUMP_IF_FALSE:
+        case OP_POP_JUMP_IF_FALSE:
+        case OP_LOOP:
+        case OP_GET_LOCAL_CONSTANT:
+        case OP_EQUAL_JUMP_IF_FALSE:
+        case OP_NOT_EQUAL_JUMP_IF_FALSE:
+        case OP_GREATER_JUMP_IF_FALSE:
+        case OP_LESS_JUMP_IF_FALSE:
+        case OP_SWITCH:
+        case OP_GET_PROPERTY:
+        case OP_SET_PROPERTY:
+            return 3;
+        case OP_CONSTANT_LONG:
+        case OP_JUMP_LONG:
+        case OP_JUMP_IF_FALSE_LONG:
+        case OP_LOOP_LONG:
+        case OP_GET_GLOBAL_LONG:
+        case OP_DEFINE_GLOBAL_LONG:
+        case OP_DEFINE_GLOBAL_LONG_CONST:
+        case OP_SET_GLOBAL_LONG:
+        case OP_CLOSURE_LONG:
+        case OP_GET_SUPER_LONG:
+        case OP_INVOKE:
+        case OP_SUPER_INVOKE:
+        case OP_CLASS_LONG:
+        case OP_METHOD_LONG:
+            return 4;
+        default:
+            return 1;
+    }
+}
+
+// Net change in stack depth from running the instruction at 'offset'.  Every instruction pops its
+// operands before it pushes a result, so the depth in between never exceeds the one after.
+static int stack_effect(bytecode_chunk* chunk, int offset) {
+    switch (chunk->code[offset]) {
+        case OP_CONSTANT:
+        case OP_CONSTANT_LONG:
+        case OP_NULL:
+        case OP_TRUE:
+        case OP_FALSE:
+        case OP_DUP:
+        case OP_GET_LOCAL:
+        case OP_GET_LOCAL_0:
+        case OP_GET_LOCAL_1:
+        case OP_GET_LOCAL_2:
+        case OP_GET_LOCAL_3:
+        case OP_GET_GLOBAL:
+        case OP_GET_GLOBAL_LONG:
+        case OP_GET_GLOBAL_DEFINED:
+        case OP_GET_UPVALUE:
+        case OP_CLOSURE:
+        case OP_CLOSURE_LONG:
+        case OP_CLASS:
+        case OP_CLASS_LONG:
+            return 1;
+        case OP_GET_LOCAL_CONSTANT:
+            return 2;
+        case OP_SET_LOCAL:
+        case OP_SET_LOCAL_0:
+        case OP_SET_LOCAL_1:
+        case OP_SET_LOCAL_2:
+        case OP_SET_LOCAL_3:
+        case OP_SET_GLOBAL:
+        case OP_SET_GLOBAL_LONG:
+        case OP_SET_UPVALUE:
+        case OP_GET_PROPERTY:
+        case OP_NOT:
+        case OP_NEGATE:
+        case OP_JUMP:
+        case OP_JUMP_LONG:
+        case OP_JUMP_IF_FALSE:
+        case OP_JUMP_IF_FALSE_LONG:
+        case OP_LOOP:
+        case OP_LOOP_LONG:
+        case OP_SWITCH:
+        case OP_DEBUG:
+            return 0;
+        case OP_EQUAL_JUMP_IF_FALSE:
+        case OP_NOT_EQUAL_JUMP_IF_FALSE:
+        case OP_GREATER_JUMP_IF_FALSE:
+        case OP_LESS_JUMP_IF_FALSE:
+            return -2;
+        case OP_CALL:
+        case OP_TAIL_CALL:
+            // The callee and its arguments make way for the result.
+            return -chunk->code[offset + 1];
+        case OP_INVOKE:
+            // Likewise the receiver and the arguments.
+            return -chunk->code[offset + 3];
+        case OP_SUPER_INVOKE:
+            // And the superclass on top of them.
+            return -chunk->code[offset + 3] - 1;
+        case OP_LIST:
+            return 1 - chunk->code[offset + 1];
+        case OP_SET_INDEX:
+            return -2;
+        default:
+            // Pops, definitions, binary operators, property stores, index reads,
+            // OP_POP_JUMP_IF_FALSE and OP_RETURN.
+            return -1;
+    }
+}
+
+// Offset the instruction at 'offset' jumps to, or -1 when it isn't a jump.
+int jump_target(bytecode_chunk* chunk, int offset) {
+    uint8_t* code = &chunk->code[offset];
+#define SHORT_JUMP() ((code[1] << 8) | code[2])
+#define LONG_JUMP() deconstruct_u24_t((u24_t){.hi = code[1], .mid = code[2], .lo = code[3]})
+
+    switch (*code) {
+        case OP_JUMP:
+        case OP_JUMP_IF_FALSE:
+        case OP_POP_JUMP_IF_FALSE:
+        case OP_EQUAL_JUMP_IF_FALSE:
+        case OP_NOT_EQUAL_JUMP_IF_FALSE:
+        case OP_GREATER_JUMP_IF_FALSE:
+        case OP_LESS_JUMP_IF_FALSE:
+            return offset + 3 + SHORT_JUMP();
+        case OP_LOOP:
+            return offset + 3 - SHORT_JUMP();
+        case OP_JUMP_LONG:
+        case OP_JUMP_IF_FALSE_LONG:
+            return offset + 4 + LONG_JUMP();
+        case OP_LOOP_LONG:
+            return offset + 4 - LONG_JUMP();
+        default:
+            return -1;
+    }
+
+#undef SHORT_JUMP
+#undef LONG_JUMP
+}
+
+// Follows every path through the chunk from 'entry_depth' (the callee and its parameters) and
+// returns the deepest the stack gets.  Paths that meet always agree on the depth, so each
+// instruction only needs visiting once.
+int chunk_max_stack(bytecode_chunk* chunk, int entry_depth) {
+    if (chunk->count == 0) {
+        return entry_depth;
+    }
+
+    int* depth_at = ALLOCATE(int, chunk->count);
+    int* pending = ALLOCATE(int, chunk->count);
+    for (int i = 0; i < chunk->count; ++i) {
+        depth_at[i] = -1;
+    }
+
+    int pending_count = 0;
+    int max_depth = entry_depth;
+    depth_at[0] = entry_depth;
+    pending[pending_count++] = 0;
+
+    while (pending_count > 0) {
+        int offset = pending[--pending_count];
+        int depth = depth_at[offset];
+
+        while (offset < chunk->count) {
+            uint8_t op = chunk->code[offset];
+            depth += stack_effect(chunk, offset);
+            if (depth > max_depth) {
+                max_depth = depth;
+            }
+
+            int target = jump_target(chunk, offset);
+            if (target >= 0 && depth_at[target] < 0) {
+                depth_at[target] = depth;
+                pending[pending_count++] = target;
+            }
+
+            if (op == OP_SWITCH) {
+                switch_table* table =
+                    &chunk->switch_tables[(chunk->code[offset + 1] << 8) | chunk->code[offset + 2]];
+                for (int i = -1; i < table->capacity; ++i) {
+                    target = i < 0 ? table->miss : table->targets[i];
+                    if (target >= 0 && depth_at[target] < 0) {
+                        depth_at[target] = depth;
+                        pending[pending_count++] = target;
+                    }
+                }
+            }
+
+            offset += opcode_length(op);
+            if (op == OP_JUMP || op == OP_JUMP_LONG || op == OP_LOOP || op == OP_LOOP_LONG ||
+                op == OP_SWITCH || op == OP_RETURN || offset >= chunk->count ||
+                depth_at[offset] >= 0) {
+                break;
+            }
+            depth_at[offset] = depth;
+        }
+    }
+
+    FREE_ARRAY(int, depth_at, chunk->count);
+    FREE_ARRAY(int, pending, chunk->count);
+    return max_depth;
+}
@@ -14,6 +14,16 @@ typedef enum {
     OP_DUP,
     OP_GET_LOCAL,
     OP_SET_LOCAL,
+    // Operand-free forms for the first four slots, which hold the parameters and first locals of
+    // most functions.
+    OP_GET_LOCAL_0,
+    OP_GET_LOCAL_1,
+    OP_GET_LOCAL_2,
+    OP_GET_LOCAL_3,
+    OP_SET_LOCAL_0,
+    OP_SET_LOCAL_1,
+    OP_SET_LOCAL_2,
+    OP_SET_LOCAL_3,
     OP_GET_GLOBAL,
     OP_GET_GLOBAL_LONG,
     OP_DEFINE_GLOBAL,
@@ -22,9 +32,23 @@ typedef enum {
     OP_DEFINE_GLOBAL_LONG_CONST,
     OP_SET_GLOBAL,
     OP_SET_GLOBAL_LONG,
+    OP_GET_UPVALUE,
+    OP_SET_UPVALUE,
+    OP_GET_PROPERTY,
+    OP_SET_PROPERTY,
+    OP_GET_SUPER,
+    OP_GET_SUPER_LONG,
+    OP_INVOKE,
+    OP_SUPER_INVOKE,
+    OP_LIST,
+    OP_GET_INDEX,
+    OP_SET_INDEX,
     OP_EQUAL,
     OP_GREATER,
     OP_LESS,
+    OP_NOT_EQUAL,
+    OP_GREATER_EQUAL,
+    OP_LESS_EQUAL,
     OP_ADD,
     OP_SUBTRACT,
     OP_MULTIPLY,
@@ -32,10 +56,42 @@ typedef enum {
     OP_NOT,
     OP_NEGATE,
     OP_JUMP,
+    OP_JUMP_LONG,
     OP_JUMP_IF_FALSE,
+    OP_JUMP_IF_FALSE_LONG,
+    OP_POP_JUMP_IF_FALSE,
     OP_LOOP,
+    OP_LOOP_LONG,
     OP_CALL,
+    OP_TAIL_CALL,
     OP_RETURN,
+    OP_CLOSURE,
+    OP_CLOSURE_LONG,
+    OP_CLOSE_UPVALUE,
+    OP_CLASS,
+    OP_CLASS_LONG,
+    OP_METHOD,
+    OP_METHOD_LONG,
+    OP_INHERIT,
+    OP_SWITCH,
+
+    // Superinstructions, only ever produced by the optimizer.  Each one stands for a pair of the
+    // opcodes above that came out on top of an opcode pair profile of the benchmarks.
+    OP_GET_LOCAL_CONSTANT,
+    OP_SET_LOCAL_POP,
+    OP_SET_GLOBAL_POP,
+    OP_EQUAL_JUMP_IF_FALSE,
+    OP_NOT_EQUAL_JUMP_IF_FALSE,
+    OP_GREATER_JUMP_IF_FALSE,
+    OP_LESS_JUMP_IF_FALSE,
+
+    // Quickened forms, never emitted by the compiler.  The VM rewrites a generic instruction into
+    // one of these in place once it has seen it run on numbers, and back again the first time the
+    // guard sees anything else.
+    OP_ADD_NUM,
+    OP_EQUAL_NUM,
+    OP_NOT_EQUAL_NUM,
+    OP_GET_GLOBAL_DEFINED,
 
     OP_DEBUG,
 } opcode;
@@ -51,6 +107,55 @@ typedef struct {
     int count;
 } line_run;
 
+// Case table for an OP_SWITCH, mapping each number or string label to the offset of its body.
+// Labels that are integers in a range no more than twice their count index 'targets' directly,
+// anything else goes in an open addressed table.  Slots without a label hold -1, and a value that
+// matches nothing jumps to 'miss'.
+typedef struct {
+    bool dense;
+    double min;
+    int capacity;
+    clox_value* keys;
+    int* targets;
+    int miss;
+} switch_table;
+
+typedef struct {
+    clox_value key;
+    int target;
+} switch_case;
+
+// How many shapes a property access remembers before it stops learning new ones.
+#define PROPERTY_CACHE_ENTRIES 4
+
+// What a property access learned about instances of one shape: the slot the field is in and, for
+// a store that added the field, the shape the instance moved on to (NULL otherwise).
+typedef struct {
+    object_shape* shape;
+    object_shape* transition;
+    int slot;
+} property_cache_entry;
+
+// Inline cache of one OP_GET_PROPERTY or OP_SET_PROPERTY.  Entries are filled in the order shapes
+// turn up, and once all of them are taken the access is megamorphic and any other shape is looked
+// up by name.  'name' is also in the chunk's constant table, which keeps it alive.
+typedef struct {
+    object_string* name;
+    int count;
+    property_cache_entry entries[PROPERTY_CACHE_ENTRIES];
+} property_cache;
+
+// Inline cache of one OP_INVOKE or OP_SUPER_INVOKE: the method 'name' was last found to be on
+// 'klass'.  An OP_INVOKE entry is only good for receivers with 'shape' as well, which is known not
+// to have a field called 'name' that would shadow the method.  Classes can't gain methods once
+// their declaration has run, so an entry never goes stale.
+typedef struct {
+    object_string* name;
+    object_class* klass;
+    object_shape* shape;
+    clox_value method;
+} method_cache;
+
 typedef struct {
     int count;
     int capacity;
@@ -61,6 +166,23 @@ typedef struct {
     line_run* line_runs;
 
     value_array constants;
+    // Open addressed index from number and string constants to their slot + 1 (0 is empty), so
+    // the same value is only ever stored once per chunk.
+    int ci_count;
+    int ci_capacity;
+    int* constant_index;
+
+    int st_count;
+    int st_capacity;
+    switch_table* switch_tables;
+
+    int pc_count;
+    int pc_capacity;
+    property_cache* property_caches;
+
+    int mc_count;
+    int mc_capacity;
+    method_cache* method_caches;
 } bytecode_chunk;
 
 void init_bytecode_chunk(bytecode_chunk* chunk);
@@ -69,6 +191,15 @@ int add_constant(bytecode_chunk* chunk, clox_value val);
 u24_t construct_u24_t(int index);
 int deconstruct_u24_t(u24_t format);
 void write_to_bytecode_chunk(bytecode_chunk* chunk, uint8_t byte, int line);
+void rewind_bytecode_chunk(bytecode_chunk* chunk, int code_count, int constant_count);
+int add_switch_table(bytecode_chunk* chunk);
+void build_switch_table(switch_table* table, switch_case* cases, int count, int miss);
+int switch_table_target(switch_table* table, clox_value val);
+int add_property_cache(bytecode_chunk* chunk, object_string* name);
+int add_method_cache(bytecode_chunk* chunk, object_string* name);
 int get_source_line(bytecode_chunk* chunk, int index);
+int opcode_length(uint8_t op);
+int jump_target(bytecode_chunk* chunk, int offset);
+int chunk_max_stack(bytecode_chunk* chunk, int entry_depth);
 
 #endif
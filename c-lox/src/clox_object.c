@@ -6,23 +6,38 @@
 
 #define ALLOCATE_OBJECT(type, object_type) (type*)allocate_object(sizeof(type), object_type)
 
-static object* allocate_object(size_t size, object_type type) {
-    object* obj = (object*)reallocate(NULL, 0, size);
+static void link_object(object* obj, object_type type, size_t size) {
     obj->type = type;
+    obj->is_marked = false;
+#ifdef CLOX_GC_GENERATIONAL
+    // New objects always start in the nursery, which is what vm.objects holds in this mode.
+    obj->is_old = false;
+    obj->is_remembered = false;
+#endif
 
     obj->next = vm.objects;
     vm.objects = obj;
 
+#ifdef DEBUG_LOG_GC
+    printf("%p allocate %zu for %d\n", (void*)obj, size, type);
+#endif
+}
+
+static object* allocate_object(size_t size, object_type type) {
+    object* obj = (object*)reallocate(NULL, 0, size);
+    link_object(obj, type, size);
     return obj;
 }
 
-// Allocates memory for our clox_object string and assigns the c-style string to it.
-static object_string* allocate_string(char* chars, int length, uint32_t hash) {
-    object_string* string = ALLOCATE_OBJECT(object_string, OBJECT_STRING);
-    string->length = length;
-    string->chars = chars;
+// Links a filled in string buffer into the heap and adds it to the intern table.
+static object_string* intern_string(object_string* string, uint32_t hash) {
     string->hash = hash;
+    link_object(&string->obj, OBJECT_STRING, STRING_SIZE(string->length));
+
+    // Growing the intern table can trigger a collection, so keep the new string reachable.
+    virtual_machine_stack_push(OBJECT_VALUE(string));
     hash_table_set(&vm.interned_strings, string, NULL_VALUE);
+    virtual_machine_stack_pop();
     return string;
 }
 
@@ -35,14 +50,96 @@ static uint32_t hash_string(const char* key, int length) {
     return hash;
 }
 
+object_bound_method* new_bound_method(clox_value receiver, clox_value method) {
+    object_bound_method* bound = ALLOCATE_OBJECT(object_bound_method, OBJECT_BOUND_METHOD);
+    bound->receiver = receiver;
+    bound->method = method;
+    return bound;
+}
+
+object_class* new_class(object_string* name) {
+    object_class* klass = ALLOCATE_OBJECT(object_class, OBJECT_CLASS);
+    klass->name = name;
+    klass->field_hint = 0;
+    init_hash_table(&klass->methods);
+    klass->methods.owner = (object*)klass;
+    return klass;
+}
+
+object_closure* new_closure(object_function* function) {
+    // The array comes first, while the function is still the only thing that needs keeping alive.
+    object_upvalue** upvalues = ALLOCATE(object_upvalue*, function->upvalue_count);
+    for (int i = 0; i < function->upvalue_count; ++i) {
+        upvalues[i] = NULL;
+    }
+
+    object_closure* closure = ALLOCATE_OBJECT(object_closure, OBJECT_CLOSURE);
+    closure->function = function;
+    closure->upvalues = upvalues;
+    closure->upvalue_count = function->upvalue_count;
+    return closure;
+}
+
 object_function* new_function(void) {
     object_function* function = ALLOCATE_OBJECT(object_function, OBJECT_FUNCTION);
     function->arity = 0;
+    function->max_stack = 0;
     function->name = NULL;
+    function->upvalue_count = 0;
+    function->captures = NULL;
     init_bytecode_chunk(&function->chunk);
     return function;
 }
 
+object_instance* new_instance(object_class* klass) {
+    // The array comes first, the caller keeps the class reachable until the instance exists.
+    int capacity = klass->field_hint;
+    clox_value* fields = NULL;
+    if (capacity > 0) {
+        fields = ALLOCATE(clox_value, capacity);
+    }
+
+    object_instance* instance = ALLOCATE_OBJECT(object_instance, OBJECT_INSTANCE);
+    instance->klass = klass;
+    instance->shape = vm.empty_shape;
+    instance->field_capacity = capacity;
+    instance->fields = fields;
+    return instance;
+}
+
+// Copies 'count' values into a new list.  They are expected to be on the stack, which keeps them
+// alive while the list and its buffer are allocated.
+object_list* new_list(clox_value* values, int count) {
+    object_list* list = ALLOCATE_OBJECT(object_list, OBJECT_LIST);
+    init_value_array(&list->items);
+    list->base = NULL;
+    list->start = 0;
+    list->count = 0;
+
+    if (count > 0) {
+        virtual_machine_stack_push(OBJECT_VALUE(list));
+        list->items.values = ALLOCATE(clox_value, count);
+        list->items.capacity = count;
+        memcpy(list->items.values, values, sizeof(clox_value) * (size_t)count);
+        list->items.count = count;
+        virtual_machine_stack_pop();
+    }
+    return list;
+}
+
+// A view of 'count' values of 'list' from 'start' on, which the caller has checked are in range.
+object_list* new_list_slice(object_list* list, int start, int count) {
+    object_list* base = list->base != NULL ? list->base : list;
+    start += list->start;
+
+    object_list* slice = ALLOCATE_OBJECT(object_list, OBJECT_LIST);
+    init_value_array(&slice->items);
+    slice->base = base;
+    slice->start = start;
+    slice->count = count;
+    return slice;
+}
+
 object_native* new_native(native_fn function, const char* name, int min_arity, int max_arity) {
     object_native* native = ALLOCATE_OBJECT(object_native, OBJECT_NATIVE);
     native->min_arity = min_arity;
@@ -52,16 +149,28 @@ object_native* new_native(native_fn function, const char* name, int min_arity, i
     return native;
 }
 
-object_string* take_string(char* chars, int length) {
-    uint32_t hash = hash_string(chars, length);
+// Allocates a string with room for 'length' characters that isn't part of the heap yet.  The
+// caller fills in chars and then hands it to take_string(), without allocating in between.
+object_string* allocate_string_buffer(int length) {
+    object_string* string = (object_string*)reallocate(NULL, 0, STRING_SIZE(length));
+    string->length = length;
+    string->chars[length] = '\0';
+    return string;
+}
 
-    object_string* interned = table_find_string(&vm.interned_strings, chars, length, hash);
+// Takes ownership of a buffer from allocate_string_buffer(), returning the interned copy instead
+// if one already exists.
+object_string* take_string(object_string* string) {
+    uint32_t hash = hash_string(string->chars, string->length);
+
+    object_string* interned =
+        table_find_string(&vm.interned_strings, string->chars, string->length, hash);
     if (interned != NULL) {
-        FREE_ARRAY(char, chars, length + 1);
+        reallocate(string, STRING_SIZE(string->length), 0);
         return interned;
     }
 
-    return allocate_string(chars, length, hash);
+    return intern_string(string, hash);
 }
 
 // Allocates memory for const char* strings.
@@ -73,10 +182,109 @@ object_string* copy_string(const char* chars, int length) {
         return interned;
     }
 
-    char* heap_chars = ALLOCATE(char, length + 1);
-    memcpy(heap_chars, chars, length);
-    heap_chars[length] = '\0';
-    return allocate_string(heap_chars, length, hash);
+    object_string* string = allocate_string_buffer(length);
+    memcpy(string->chars, chars, length);
+    return intern_string(string, hash);
+}
+
+object_upvalue* new_upvalue(clox_value* slot) {
+    object_upvalue* upvalue = ALLOCATE_OBJECT(object_upvalue, OBJECT_UPVALUE);
+    upvalue->location = slot;
+    upvalue->closed = NULL_VALUE;
+    upvalue->next = NULL;
+    return upvalue;
+}
+
+object_shape* new_shape(void) {
+    object_shape* shape = ALLOCATE_OBJECT(object_shape, OBJECT_SHAPE);
+    shape->field_count = 0;
+    init_hash_table(&shape->slots);
+    init_hash_table(&shape->transitions);
+    shape->slots.owner = (object*)shape;
+    shape->transitions.owner = (object*)shape;
+    return shape;
+}
+
+// Returns the shape 'shape' turns into once a field called 'name' is added to it, building it the
+// first time.  Transitions are never dropped, every shape stays reachable from the empty one.
+object_shape* shape_add_field(object_shape* shape, object_string* name) {
+    clox_value next;
+    if (hash_table_get(&shape->transitions, name, &next)) {
+        return (object_shape*)AS_OBJECT(next);
+    }
+
+    virtual_machine_stack_push(OBJECT_VALUE(shape));
+    object_shape* added = new_shape();
+    virtual_machine_stack_push(OBJECT_VALUE(added));
+
+    hash_table_add_all(&shape->slots, &added->slots);
+    hash_table_set(&added->slots, name, NUMBER_VALUE(shape->field_count));
+    added->field_count = shape->field_count + 1;
+    hash_table_set(&shape->transitions, name, OBJECT_VALUE(added));
+
+    virtual_machine_stack_pop();
+    virtual_machine_stack_pop();
+    return added;
+}
+
+// Index of the field called 'name' in instances of 'shape', or -1 if they don't have one.
+int shape_slot(object_shape* shape, object_string* name) {
+    clox_value slot;
+    if (!hash_table_get(&shape->slots, name, &slot)) {
+        return -1;
+    }
+    return (int)AS_NUMBER(slot);
+}
+
+// Stores 'val' in the field called 'name', adding it if the instance doesn't have one yet, and
+// returns the slot it went in.
+int instance_set_field(object_instance* instance, object_string* name, clox_value val) {
+    int slot = shape_slot(instance->shape, name);
+
+    if (slot < 0) {
+        // Both stay on the stack while the new shape and a bigger field array are allocated.
+        virtual_machine_stack_push(OBJECT_VALUE(instance));
+        virtual_machine_stack_push(val);
+
+        object_shape* shape = shape_add_field(instance->shape, name);
+        if (shape->field_count > instance->field_capacity) {
+            int old_capacity = instance->field_capacity;
+            instance->field_capacity = old_capacity < 4 ? 4 : old_capacity * 2;
+            instance->fields =
+                GROW_ARRAY(clox_value, instance->fields, old_capacity, instance->field_capacity);
+        }
+        instance->shape = shape;
+        write_barrier((object*)instance, OBJECT_VALUE(shape));
+
+        object_class* klass = instance->klass;
+        if (shape->field_count > klass->field_hint) {
+            klass->field_hint = shape->field_count;
+        }
+
+        slot = shape->field_count - 1;
+        virtual_machine_stack_pop();
+        virtual_machine_stack_pop();
+    }
+
+    instance->fields[slot] = val;
+    write_barrier((object*)instance, val);
+    return slot;
+}
+
+// Both take a list that owns its buffer and expect it, and 'val', to be on the stack.
+void list_append(object_list* list, clox_value val) {
+    write_to_value_array(&list->items, val);
+    write_barrier((object*)list, val);
+}
+
+void list_insert(object_list* list, int index, clox_value val) {
+    // Grows the buffer by one, then opens up the gap.
+    write_to_value_array(&list->items, val);
+    clox_value* values = list->items.values;
+    memmove(values + index + 1, values + index,
+            sizeof(clox_value) * (size_t)(list->items.count - 1 - index));
+    values[index] = val;
+    write_barrier((object*)list, val);
 }
 
 void print_function(object_function* function) {
@@ -91,14 +299,46 @@ void print_string(object_string* str) { printf("%s", str->chars); }
 
 void print_object(clox_value val) {
     switch (OBJECT_TYPE(val)) {
+        case OBJECT_BOUND_METHOD: {
+            clox_value method = AS_BOUND_METHOD(val)->method;
+            print_function(IS_CLOSURE(method) ? AS_CLOSURE(method)->function
+                                              : AS_FUNCTION(method));
+        } break;
+        case OBJECT_CLASS:
+            printf("%s", AS_CLASS(val)->name->chars);
+            break;
+        case OBJECT_CLOSURE:
+            print_function(AS_CLOSURE(val)->function);
+            break;
         case OBJECT_FUNCTION:
             print_function(AS_FUNCTION(val));
             break;
+        case OBJECT_INSTANCE:
+            printf("%s instance", AS_INSTANCE(val)->klass->name->chars);
+            break;
+        case OBJECT_LIST: {
+            int length;
+            clox_value* values = list_values(AS_LIST(val), &length);
+            printf("[");
+            for (int i = 0; i < length; ++i) {
+                if (i > 0) {
+                    printf(", ");
+                }
+                print_value(values[i]);
+            }
+            printf("]");
+        } break;
         case OBJECT_NATIVE:
             printf("<native fn>");
             break;
+        case OBJECT_SHAPE:
+            printf("shape");
+            break;
         case OBJECT_STRING:
             printf("%s", AS_CSTRING(val));
             break;
+        case OBJECT_UPVALUE:
+            printf("upvalue");
+            break;
     }
 }
@@ -2,31 +2,71 @@
 #define JUMI_CLOX_CLOX_OBJECT_H
 #include "bytecode_chunk.h"
 #include "clox_value.h"
+#include "hash_table.h"
 
 #define OBJECT_TYPE(val) (AS_OBJECT(val)->type)
 
+#define IS_BOUND_METHOD(val) is_object_type(val, OBJECT_BOUND_METHOD)
+#define IS_CLASS(val) is_object_type(val, OBJECT_CLASS)
+#define IS_CLOSURE(val) is_object_type(val, OBJECT_CLOSURE)
 #define IS_FUNCTION(val) is_object_type(val, OBJECT_FUNCTION)
+#define IS_INSTANCE(val) is_object_type(val, OBJECT_INSTANCE)
+#define IS_LIST(val) is_object_type(val, OBJECT_LIST)
 #define IS_NATIVE(val) is_object_type(val, OBJECT_NATIVE)
 #define IS_STRING(val) is_object_type(val, OBJECT_STRING)
 
+#define AS_BOUND_METHOD(val) ((object_bound_method*)AS_OBJECT(val))
+#define AS_CLASS(val) ((object_class*)AS_OBJECT(val))
+#define AS_CLOSURE(val) ((object_closure*)AS_OBJECT(val))
 #define AS_FUNCTION(val) ((object_function*)AS_OBJECT(val))
+#define AS_INSTANCE(val) ((object_instance*)AS_OBJECT(val))
+#define AS_LIST(val) ((object_list*)AS_OBJECT(val))
 #define AS_NATIVE(val) ((object_native*)AS_OBJECT(val))
 #define AS_STRING(val) ((object_string*)AS_OBJECT(val))
 
 #define AS_CSTRING(val) (((object_string*)AS_OBJECT(val))->chars)
 
-typedef enum { OBJECT_FUNCTION, OBJECT_NATIVE, OBJECT_STRING } object_type;
+typedef enum {
+    OBJECT_BOUND_METHOD,
+    OBJECT_CLASS,
+    OBJECT_CLOSURE,
+    OBJECT_FUNCTION,
+    OBJECT_INSTANCE,
+    OBJECT_LIST,
+    OBJECT_NATIVE,
+    OBJECT_SHAPE,
+    OBJECT_STRING,
+    OBJECT_UPVALUE,
+} object_type;
 
 struct object {
     object_type type;
+    bool is_marked;
+#ifdef CLOX_GC_GENERATIONAL
+    bool is_old;
+    bool is_remembered;
+#endif
     struct object* next;
 };
 
+// Where a closure finds one of its upvalues when it is created: a slot in the frame of the
+// function it is created in, or one of that function's own upvalues.
+typedef struct {
+    uint8_t index;
+    bool is_local;
+} upvalue_capture;
+
 typedef struct {
     object obj;
     int arity;
+    // Deepest the value stack gets above the frame's slots, worked out by the compiler so that a
+    // call only has to check for room once.
+    int max_stack;
     bytecode_chunk chunk;
     object_string* name;
+    // A function that captures nothing is called as is, only the others are wrapped in a closure.
+    int upvalue_count;
+    upvalue_capture* captures;
 } object_function;
 
 typedef clox_value (*native_fn)(int arg_count, clox_value* args);
@@ -39,17 +79,101 @@ typedef struct {
     int max_arity;
 } object_native;
 
+// The characters live inline right after the header, so a string is a single allocation and
+// comparing one never chases a second pointer.
 struct object_string {
     object obj;
     int length;
-    char* chars;
     uint32_t hash;
+    char chars[];
+};
+
+#define STRING_SIZE(length) (sizeof(object_string) + (size_t)(length) + 1)
+
+// While the variable it captured is still on the stack an upvalue is open and points at its slot.
+// Once the variable goes out of scope its value moves into 'closed' and the upvalue points there.
+typedef struct object_upvalue {
+    object obj;
+    clox_value* location;
+    clox_value closed;
+    // Open upvalues are kept in a list sorted from the top of the stack down.
+    struct object_upvalue* next;
+} object_upvalue;
+
+typedef struct {
+    object obj;
+    object_function* function;
+    object_upvalue** upvalues;
+    int upvalue_count;
+} object_closure;
+
+// The layout shared by every instance that was given the same fields in the same order.  'slots'
+// maps each field name to its index in an instance's field array.  Adding a field moves an
+// instance on to the shape with that field appended, which is only built the first time and then
+// found again through 'transitions', so instances of a class built the same way share one chain of
+// shapes and hold nothing but their values.
+struct object_shape {
+    object obj;
+    int field_count;
+    hash_table slots;
+    hash_table transitions;
+};
+
+struct object_class {
+    object obj;
+    object_string* name;
+    hash_table methods;
+    // The most fields any instance of the class has had so far, so new ones can be given room for
+    // all of them up front.
+    int field_hint;
 };
 
+typedef struct {
+    object obj;
+    object_class* klass;
+    object_shape* shape;
+    int field_capacity;
+    clox_value* fields;
+} object_instance;
+
+// A method read off an instance without calling it straight away.  The method is a function, or
+// a closure if it captures anything.
+typedef struct {
+    object obj;
+    clox_value receiver;
+    clox_value method;
+} object_bound_method;
+
+// A list owns its values in 'items', which grows like any other value_array.  A slice instead
+// views 'count' values of the buffer of 'base' from 'start' on: nothing is copied, stores go
+// through to 'base', and its length can't change.  'base' always owns its buffer, a slice of a
+// slice views the same list the first one did.
+typedef struct object_list {
+    object obj;
+    value_array items;
+    struct object_list* base;
+    int start;
+    int count;
+} object_list;
+
+object_bound_method* new_bound_method(clox_value receiver, clox_value method);
+object_class* new_class(object_string* name);
+object_closure* new_closure(object_function* function);
 object_function* new_function(void);
+object_instance* new_instance(object_class* klass);
+object_list* new_list(clox_value* values, int count);
+object_list* new_list_slice(object_list* list, int start, int count);
 object_native* new_native(native_fn function, const char* name, int min_arity, int max_arity);
-object_string* take_string(char* chars, int length);
+object_string* allocate_string_buffer(int length);
+object_string* take_string(object_string* string);
 object_string* copy_string(const char* chars, int length);
+object_upvalue* new_upvalue(clox_value* slot);
+object_shape* new_shape(void);
+object_shape* shape_add_field(object_shape* shape, object_string* name);
+int shape_slot(object_shape* shape, object_string* name);
+int instance_set_field(object_instance* instance, object_string* name, clox_value val);
+void list_append(object_list* list, clox_value val);
+void list_insert(object_list* list, int index, clox_value val);
 void print_function(object_function* val);
 void print_object(clox_value val);
 void print_string(object_string* str);
@@ -58,4 +182,32 @@ static inline bool is_object_type(clox_value val, object_type type) {
     return IS_OBJECT(val) && AS_OBJECT(val)->type == type;
 }
 
+// The values a list holds right now, and how many.  A slice comes up short once the list it views
+// has shrunk below its end.
+static inline clox_value* list_values(object_list* list, int* length) {
+    if (list->base == NULL) {
+        *length = list->items.count;
+        return list->items.values;
+    }
+
+    int available = list->base->items.count - list->start;
+    *length = list->count < available ? list->count : (available > 0 ? available : 0);
+    return list->base->items.values + list->start;
+}
+
+// The slot 'index' names in a list of 'length' values, or -1 unless it is a whole number in range.
+static inline int list_slot(clox_value index, int length) {
+    if (!IS_NUMBER(index)) {
+        return -1;
+    }
+
+    double d = AS_NUMBER(index);
+    if (!(d >= 0 && d < length)) {
+        return -1;
+    }
+
+    int slot = (int)d;
+    return slot == d ? slot : -1;
+}
+
 #endif
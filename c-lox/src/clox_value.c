@@ -5,6 +5,14 @@
 #include <string.h>
 
 bool values_equal(clox_value a, clox_value b) {
+#ifdef CLOX_NAN_BOXING
+    // Numbers still need a floating point compare so that NaN != NaN, every other value is equal
+    // exactly when its bits are.
+    if (IS_NUMBER(a) && IS_NUMBER(b)) {
+        return AS_NUMBER(a) == AS_NUMBER(b);
+    }
+    return a == b;
+#else
     if (a.type != b.type) {
         return false;
     }
@@ -22,6 +30,7 @@ bool values_equal(clox_value a, clox_value b) {
         default:
             return false;
     }
+#endif
 }
 
 void init_value_array(value_array* array) {
@@ -31,7 +40,7 @@ void init_value_array(value_array* array) {
 }
 
 void free_value_array(value_array* array) {
-    FREE_ARRAY(uint8_t, array->values, array->capacity);
+    FREE_ARRAY(clox_value, array->values, array->capacity);
     init_value_array(array);
 }
 
@@ -47,6 +56,17 @@ void write_to_value_array(value_array* array, clox_value val) {
 }
 
 void print_value(clox_value val) {
+#ifdef CLOX_NAN_BOXING
+    if (IS_BOOL(val)) {
+        printf(AS_BOOL(val) ? "true" : "false");
+    } else if (IS_NULL(val)) {
+        printf("null");
+    } else if (IS_NUMBER(val)) {
+        printf("%g", AS_NUMBER(val));
+    } else if (IS_OBJECT(val)) {
+        print_object(val);
+    }
+#else
     switch (val.type) {
         case CLOX_VAL_BOOL: {
             printf(AS_BOOL(val) ? "true" : "false");
@@ -61,4 +81,5 @@ void print_value(clox_value val) {
             print_object(val);
         } break;
     }
+#endif
 }
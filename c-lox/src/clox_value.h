@@ -4,6 +4,54 @@
 
 typedef struct object object;
 typedef struct object_string object_string;
+typedef struct object_class object_class;
+typedef struct object_shape object_shape;
+
+#ifdef CLOX_NAN_BOXING
+#include <string.h>
+
+// A NaN-boxed value is a single 64 bit word.  Any bit pattern that isn't a quiet NaN is a double.
+// Quiet NaNs with the sign bit set hold an object pointer in the low 48 bits, and the remaining
+// quiet NaNs are singletons tagged in the two lowest bits (null, false, true).
+#define SIGN_BIT ((uint64_t)0x8000000000000000)
+#define QNAN ((uint64_t)0x7FFC000000000000)
+
+#define TAG_NULL 1
+#define TAG_FALSE 2
+#define TAG_TRUE 3
+
+typedef uint64_t clox_value;
+
+#define FALSE_VAL ((clox_value)(uint64_t)(QNAN | TAG_FALSE))
+#define TRUE_VAL ((clox_value)(uint64_t)(QNAN | TAG_TRUE))
+
+#define IS_BOOL(val) (((val) | 1) == TRUE_VAL)
+#define IS_NULL(val) ((val) == NULL_VALUE)
+#define IS_NUMBER(val) (((val) & QNAN) != QNAN)
+#define IS_OBJECT(val) (((val) & (QNAN | SIGN_BIT)) == (QNAN | SIGN_BIT))
+
+#define AS_OBJECT(val) ((object*)(uintptr_t)((val) & ~(SIGN_BIT | QNAN)))
+#define AS_BOOL(val) ((val) == TRUE_VAL)
+#define AS_NUMBER(val) value_to_number(val)
+
+#define BOOL_VALUE(val) ((val) ? TRUE_VAL : FALSE_VAL)
+#define NULL_VALUE ((clox_value)(uint64_t)(QNAN | TAG_NULL))
+#define NUMBER_VALUE(val) number_to_value(val)
+#define OBJECT_VALUE(val) (clox_value)(SIGN_BIT | QNAN | (uint64_t)(uintptr_t)(val))
+
+static inline double value_to_number(clox_value val) {
+    double num;
+    memcpy(&num, &val, sizeof(clox_value));
+    return num;
+}
+
+static inline clox_value number_to_value(double num) {
+    clox_value val;
+    memcpy(&val, &num, sizeof(double));
+    return val;
+}
+
+#else
 
 typedef enum {
     CLOX_VAL_BOOL,
@@ -35,6 +83,8 @@ typedef struct {
 #define NUMBER_VALUE(val) ((clox_value){CLOX_VAL_NUMBER, {.number = val}})
 #define OBJECT_VALUE(val) ((clox_value){CLOX_VAL_OBJECT, {.obj = (object*)val}})
 
+#endif
+
 typedef struct {
     int count;
     int capacity;
@@ -3,6 +3,9 @@
 #include "clox_object.h"
 #include "common.h"
 #include "lexer.h"
+#include "memory.h"
+#include "optimizer.h"
+#include "virtual_machine.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -50,7 +53,8 @@
 // defaultCase  → "default" ":" statement* ;
 //
 // expression   → assignment ;
-// assignment   → ( call ".")? IDENTIFIER "=" assignment | logic_or ;
+// assignment   → ( call "." IDENTIFIER | call "[" expression "]" | IDENTIFIER ) "=" assignment
+//              | logic_or ;
 // logic_or     → logic_and ( "or" logic_and )* ;
 // logic_and    → equality ( "and" equality )* ;
 // equality     → comparison ( ( "!=" | "==" ) comparison )* ;
@@ -58,9 +62,9 @@
 // term         → factor ( ( "-" | "+" ) factor )* ;
 // factor       → unary ( ( "/" | "*" ) unary )* ;
 // unary        → ( "!" | "-" ) unary | call;
-// call         → primary ( "(" arguments? ")" | "." IDENTIFIER )* ;
+// call         → primary ( "(" arguments? ")" | "." IDENTIFIER | "[" expression "]" )* ;
 // primary      → "true" | "false" | "null" | "this" | NUMBER | STRING | IDENTIFIER
-//                 | "(" expression ")" | "super" "." IDENTIFIER ;
+//                 | "(" expression ")" | "[" arguments? "]" | "super" "." IDENTIFIER ;
 //
 // function     → IDENTIFIER "(" parameters? ")" blockStmt ;
 // parameters   → IDENTIFIER ( "," IDENTIFIER )* ;
@@ -106,13 +110,33 @@ typedef struct {
     token name;
     int depth;
     bool is_const;
+    // Set once a closure captures the local, so leaving its scope moves it off the stack.
+    bool is_captured;
 } local_variable;
 
+typedef struct {
+    upvalue_capture capture;
+    bool is_const;
+} upvalue_variable;
+
 typedef enum {
     TYPE_FUNCTION,
+    TYPE_INITIALIZER,
+    TYPE_METHOD,
     TYPE_SCRIPT,
 } function_type;
 
+// The last expression emitted that has a value known at compile time.  It spans the code from
+// 'start' to 'end' and added every constant from 'constant_count' on, and only counts as an
+// operand while nothing else has been emitted after it.
+typedef struct {
+    bool valid;
+    int start;
+    int end;
+    int constant_count;
+    clox_value val;
+} constant_expression;
+
 typedef struct compiler {
     struct compiler* enclosing_compiler;
     object_function* function;
@@ -120,20 +144,39 @@ typedef struct compiler {
 
     local_variable locals[UINT8_COUNT];
     int local_count;
+    upvalue_variable upvalues[UINT8_COUNT];
     int scope_depth;
+
+    constant_expression last_constant;
+    // Offset of the last OP_CALL emitted, so 'return' can tell when its value is a call.
+    int last_call;
+
+    // Jumps patch_jump couldn't fit in 16 bits, widened once the function is complete.
+    far_jump* far_jumps;
+    int far_jump_count;
+    int far_jump_capacity;
 } compiler;
 
+// One per class body being compiled, so 'this' and 'super' know whether they are allowed.
+typedef struct class_compiler {
+    struct class_compiler* enclosing_class;
+    bool has_superclass;
+} class_compiler;
+
 token_parser parser;
 compiler* current_compiler = NULL;
+class_compiler* current_class = NULL;
 bytecode_chunk* compiling_chunk;
+static bool optimize_bytecode = false;
 
 static bytecode_chunk* current_chunk(void) { return &current_compiler->function->chunk; }
 
 static void parse_expression(void);
 static void statement(void);
 static void declaration_statement(void);
-static int identifier_constant(token* name);
+static int global_slot(token* name);
 static int resolve_local(compiler* comp, token* name);
+static int resolve_upvalue(compiler* comp, token* name);
 static void and_(bool can_assign);
 static void or_(bool can_assign);
 static void variable_declaration(bool is_const);
@@ -226,15 +269,19 @@ static void emit_bytes4(uint8_t byte1, uint8_t byte2, uint8_t byte3, uint8_t byt
 }
 
 static void emit_loop(int loop_start) {
-    emit_byte(OP_LOOP);
+    int offset = current_chunk()->count - loop_start + 3;
+    if (offset <= UINT16_MAX) {
+        emit_bytes3(OP_LOOP, (offset >> 8) & 0xFF, offset & 0xFF);
+        return;
+    }
 
-    int offset = current_chunk()->count - loop_start + 2;
-    if (offset > UINT16_MAX) {
+    ++offset;
+    if (offset > (int)U24T_MAX) {
         error("Loop body too large.");
     }
 
-    emit_byte((offset >> 8) & 0xFF);
-    emit_byte(offset & 0xFF);
+    u24_t i = construct_u24_t(offset);
+    emit_bytes4(OP_LOOP_LONG, i.hi, i.mid, i.lo);
 }
 
 // Writes the jump instruction and returns the index of the first 0xFF placeholder byte.
@@ -244,17 +291,29 @@ static int emit_jump(uint8_t instruction) {
 }
 
 static void emit_return(void) {
-    emit_byte(OP_NULL);
+    // An initializer always hands back the instance it was called on.
+    if (current_compiler->type == TYPE_INITIALIZER) {
+        emit_byte(OP_GET_LOCAL_0);
+    } else {
+        emit_byte(OP_NULL);
+    }
     emit_byte(OP_RETURN);
 }
 
-static void emit_constant(clox_value val) {
-    int index = add_constant(current_chunk(), val);
+static int make_constant(clox_value val) {
+    int constant = add_constant(current_chunk(), val);
+    write_barrier((object*)current_compiler->function, val);
 
-    if ((unsigned int)index >= U24T_MAX) {
+    if ((unsigned int)constant >= U24T_MAX) {
         error("Too many constants in one chunk.");
+        return 0;
     }
 
+    return constant;
+}
+
+static void emit_constant(clox_value val) {
+    int index = make_constant(val);
     bool long_instr = index > 255;
 
     if (!long_instr) {
@@ -265,11 +324,40 @@ static void emit_constant(clox_value val) {
     }
 }
 
+// Emits an instruction whose operand is a constant index, using its _LONG form past 255.
+static void emit_constant_operand(uint8_t instruction, uint8_t long_instruction, int constant) {
+    if (constant <= 255) {
+        emit_bytes2(instruction, (uint8_t)constant);
+    } else {
+        u24_t i = construct_u24_t(constant);
+        emit_bytes4(long_instruction, i.hi, i.mid, i.lo);
+    }
+}
+
+static int identifier_constant(token* name) {
+    return make_constant(OBJECT_VALUE(copy_string(name->start, name->length)));
+}
+
 static void patch_jump(int offset) {
     int jump = current_chunk()->count - offset - 2;
 
+    // The current position is now a jump target, so whatever came right before it can no longer be
+    // folded into what follows.
+    current_compiler->last_constant.valid = false;
+
+    // Too far for the operand, the jump gets its real target once the whole function has been
+    // compiled and can be laid out again with room for a wide one.
     if (jump > UINT16_MAX) {
-        error("Too much code to jump over.");
+        compiler* comp = current_compiler;
+        if (comp->far_jump_count >= comp->far_jump_capacity) {
+            int old_capacity = comp->far_jump_capacity;
+            comp->far_jump_capacity = GROW_CAPACITY(old_capacity);
+            comp->far_jumps =
+                GROW_ARRAY(far_jump, comp->far_jumps, old_capacity, comp->far_jump_capacity);
+        }
+        comp->far_jumps[comp->far_jump_count++] =
+            (far_jump){.offset = offset - 1, .target = current_chunk()->count};
+        return;
     }
 
     current_chunk()->code[offset] = (jump >> 8) & 0xFF;
@@ -282,24 +370,61 @@ static void init_compiler(compiler* comp, function_type type) {
     comp->type = type;
     comp->local_count = 0;
     comp->scope_depth = 0;
+    comp->last_constant.valid = false;
+    comp->last_call = -1;
+    comp->far_jumps = NULL;
+    comp->far_jump_count = 0;
+    comp->far_jump_capacity = 0;
     comp->function = new_function();
     current_compiler = comp;
 
     if (type != TYPE_SCRIPT) {
         current_compiler->function->name =
             copy_string(parser.previous.start, parser.previous.length);
+        write_barrier((object*)current_compiler->function,
+                      OBJECT_VALUE(current_compiler->function->name));
     }
 
-    // The compiler claims slot 0 in the locals array for its own internal use.
+    // The compiler claims slot 0 in the locals array for its own internal use.  In methods it
+    // holds the receiver, reachable as 'this'.
     local_variable* local = &current_compiler->locals[current_compiler->local_count++];
     local->depth = 0;
-    local->name.start = "";
-    local->name.length = 0;
+    local->is_const = false;
+    local->is_captured = false;
+    if (type != TYPE_FUNCTION) {
+        local->name.start = "this";
+        local->name.length = 4;
+    } else {
+        local->name.start = "";
+        local->name.length = 0;
+    }
 }
 
 static object_function* end_compilation(void) {
     emit_return();
     object_function* function = current_compiler->function;
+
+    if (function->upvalue_count > 0) {
+        function->captures = ALLOCATE(upvalue_capture, function->upvalue_count);
+        for (int i = 0; i < function->upvalue_count; ++i) {
+            function->captures[i] = current_compiler->upvalues[i].capture;
+        }
+    }
+
+    if (current_compiler->far_jump_count > 0) {
+        if (!parser.had_error) {
+            widen_jumps(current_chunk(), current_compiler->far_jumps,
+                        current_compiler->far_jump_count);
+        }
+        FREE_ARRAY(far_jump, current_compiler->far_jumps, current_compiler->far_jump_capacity);
+    }
+
+    if (optimize_bytecode && !parser.had_error) {
+        optimize_chunk(current_chunk());
+    }
+    if (!parser.had_error) {
+        function->max_stack = chunk_max_stack(current_chunk(), function->arity + 1);
+    }
 #ifdef DEBUG_PRINT_CODE
     if (!parser.had_error) {
         disassemble_chunk(current_chunk(),
@@ -318,7 +443,7 @@ static void end_scope(void) {
     compiler* comp = current_compiler;
 
     while (comp->local_count > 0 && comp->locals[comp->local_count - 1].depth > comp->scope_depth) {
-        emit_byte(OP_POP);
+        emit_byte(comp->locals[comp->local_count - 1].is_captured ? OP_CLOSE_UPVALUE : OP_POP);
         --comp->local_count;
     }
 }
@@ -327,11 +452,124 @@ static void parse_expression(void);
 static parse_rule* get_rule(token_type type);
 static void parse_precedence(precedence prec);
 
+// Emits a value known at compile time and records it as a candidate operand for folding.
+static void emit_constant_expression(clox_value val) {
+    constant_expression* last = &current_compiler->last_constant;
+    int start = current_chunk()->count;
+    int constant_count = current_chunk()->constants.count;
+
+    if (IS_NULL(val)) {
+        emit_byte(OP_NULL);
+    } else if (IS_BOOL(val)) {
+        emit_byte(AS_BOOL(val) ? OP_TRUE : OP_FALSE);
+    } else {
+        emit_constant(val);
+    }
+
+    last->valid = true;
+    last->start = start;
+    last->end = current_chunk()->count;
+    last->constant_count = constant_count;
+    last->val = val;
+}
+
+// Returns the constant expression that starts at 'start' and ends at the current position, if the
+// code emitted there is one.
+static bool constant_operand(int start, constant_expression* out) {
+    constant_expression* last = &current_compiler->last_constant;
+    if (!last->valid || last->end != current_chunk()->count || last->start != start) {
+        return false;
+    }
+
+    *out = *last;
+    return true;
+}
+
+// Replaces the code and constants of the folded operands that start at 'operand' with 'result'.
+static void emit_folded(constant_expression* operand, clox_value result) {
+    rewind_bytecode_chunk(current_chunk(), operand->start, operand->constant_count);
+    emit_constant_expression(result);
+}
+
+static bool is_falsey_constant(clox_value val) {
+    return IS_NULL(val) || (IS_BOOL(val) && !AS_BOOL(val));
+}
+
+// Computes 'a op b' the way the VM would.  Anything that would be a runtime error is left alone so
+// the error still happens at runtime.
+static bool fold_binary(token_type operator_type, clox_value a, clox_value b, clox_value* result) {
+    if (operator_type == TOKEN_EQUAL_EQUAL || operator_type == TOKEN_BANG_EQUAL) {
+        bool equal = values_equal(a, b);
+        *result = BOOL_VALUE(operator_type == TOKEN_EQUAL_EQUAL ? equal : !equal);
+        return true;
+    }
+
+    if (operator_type == TOKEN_PLUS && IS_STRING(a) && IS_STRING(b)) {
+        // Both operands are still in the constant table, so they survive the allocation.
+        object_string* left = AS_STRING(a);
+        object_string* right = AS_STRING(b);
+        object_string* str = allocate_string_buffer(left->length + right->length);
+        memcpy(str->chars, left->chars, left->length);
+        memcpy(str->chars + left->length, right->chars, right->length);
+        *result = OBJECT_VALUE(take_string(str));
+        return true;
+    }
+
+    if (!IS_NUMBER(a) || !IS_NUMBER(b)) {
+        return false;
+    }
+
+    double x = AS_NUMBER(a);
+    double y = AS_NUMBER(b);
+    switch (operator_type) {
+        case TOKEN_GREATER:
+            *result = BOOL_VALUE(x > y);
+            break;
+        case TOKEN_GREATER_EQUAL:
+            *result = BOOL_VALUE(!(x < y));
+            break;
+        case TOKEN_LESS:
+            *result = BOOL_VALUE(x < y);
+            break;
+        case TOKEN_LESS_EQUAL:
+            *result = BOOL_VALUE(!(x > y));
+            break;
+        case TOKEN_PLUS:
+            *result = NUMBER_VALUE(x + y);
+            break;
+        case TOKEN_MINUS:
+            *result = NUMBER_VALUE(x - y);
+            break;
+        case TOKEN_STAR:
+            *result = NUMBER_VALUE(x * y);
+            break;
+        case TOKEN_SLASH:
+            *result = NUMBER_VALUE(x / y);
+            break;
+        default:
+            return false;
+    }
+    return true;
+}
+
 static void binary(bool can_assign) {
     token_type operator_type = parser.previous.type;
     parse_rule* rule = get_rule(operator_type);
+
+    constant_expression left;
+    constant_expression* last = &current_compiler->last_constant;
+    bool left_constant = last->valid && constant_operand(last->start, &left);
+
     parse_precedence((precedence)(rule->prec + 1));
 
+    constant_expression right;
+    clox_value result;
+    if (left_constant && constant_operand(left.end, &right) &&
+        fold_binary(operator_type, left.val, right.val, &result)) {
+        emit_folded(&left, result);
+        return;
+    }
+
     switch (operator_type) {
         case TOKEN_BANG_EQUAL:
             emit_bytes2(OP_EQUAL, OP_NOT);
@@ -370,19 +608,88 @@ static void binary(bool can_assign) {
 
 static void call(bool can_assign) {
     uint8_t arg_count = argument_list();
+    current_compiler->last_call = current_chunk()->count;
     emit_bytes2(OP_CALL, arg_count);
 }
 
+// Property accesses name the inline cache they use, which in turn holds the property's name.
+static void emit_property(uint8_t instruction, int name) {
+    bytecode_chunk* chunk = current_chunk();
+    int cache = add_property_cache(chunk, AS_STRING(chunk->constants.values[name]));
+    if (cache > UINT16_MAX) {
+        error("Too many property accesses in one function.");
+        return;
+    }
+
+    emit_bytes3(instruction, (cache >> 8) & 0xFF, cache & 0xFF);
+}
+
+// Method calls likewise name a cache of their own, followed by the argument count.
+static void emit_invoke(uint8_t instruction, int name, uint8_t arg_count) {
+    bytecode_chunk* chunk = current_chunk();
+    int cache = add_method_cache(chunk, AS_STRING(chunk->constants.values[name]));
+    if (cache > UINT16_MAX) {
+        error("Too many method calls in one function.");
+        return;
+    }
+
+    emit_bytes4(instruction, (cache >> 8) & 0xFF, cache & 0xFF, arg_count);
+}
+
+static void dot(bool can_assign) {
+    consume_if_matches(TOKEN_IDENTIFIER, "Expected property name after '.'.");
+    int name = identifier_constant(&parser.previous);
+
+    if (can_assign && matches_token(TOKEN_EQUAL)) {
+        parse_expression();
+        emit_property(OP_SET_PROPERTY, name);
+    } else if (matches_token(TOKEN_LEFT_PAREN)) {
+        // Calling a method straight away, which doesn't need a bound method in between.
+        uint8_t arg_count = argument_list();
+        emit_invoke(OP_INVOKE, name, arg_count);
+    } else {
+        emit_property(OP_GET_PROPERTY, name);
+    }
+}
+
+static void subscript(bool can_assign) {
+    parse_expression();
+    consume_if_matches(TOKEN_RIGHT_BRACKET, "Expected ']' after index.");
+
+    if (can_assign && matches_token(TOKEN_EQUAL)) {
+        parse_expression();
+        emit_byte(OP_SET_INDEX);
+    } else {
+        emit_byte(OP_GET_INDEX);
+    }
+}
+
+static void list_literal(bool can_assign) {
+    int count = 0;
+    if (!check_token(TOKEN_RIGHT_BRACKET)) {
+        do {
+            if (count == 255) {
+                error("Can't have more than 255 items in a list literal.");
+            }
+
+            parse_expression();
+            ++count;
+        } while (matches_token(TOKEN_COMMA));
+    }
+    consume_if_matches(TOKEN_RIGHT_BRACKET, "Expected ']' after list items.");
+    emit_bytes2(OP_LIST, (uint8_t)count);
+}
+
 static void literal(bool can_assign) {
     switch (parser.previous.type) {
         case TOKEN_NULL: {
-            emit_byte(OP_NULL);
+            emit_constant_expression(NULL_VALUE);
         } break;
         case TOKEN_TRUE: {
-            emit_byte(OP_TRUE);
+            emit_constant_expression(BOOL_VALUE(true));
         } break;
         case TOKEN_FALSE: {
-            emit_byte(OP_FALSE);
+            emit_constant_expression(BOOL_VALUE(false));
         } break;
         default:
             return;
@@ -396,11 +703,12 @@ static void grouping(bool can_assign) {
 
 static void number(bool can_assign) {
     double val = strtod(parser.previous.start, NULL);
-    emit_constant(NUMBER_VALUE(val));
+    emit_constant_expression(NUMBER_VALUE(val));
 }
 
 static void string(bool can_assign) {
-    emit_constant(OBJECT_VALUE(copy_string(parser.previous.start + 1, parser.previous.length - 2)));
+    emit_constant_expression(
+        OBJECT_VALUE(copy_string(parser.previous.start + 1, parser.previous.length - 2)));
 }
 
 static void named_variable(token name, bool can_assign) {
@@ -421,12 +729,31 @@ static void named_variable(token name, bool can_assign) {
             parse_expression();
         }
 
-        emit_bytes2(is_set ? OP_SET_LOCAL : OP_GET_LOCAL, (uint8_t)local);
+        if (local < 4) {
+            emit_byte((is_set ? OP_SET_LOCAL_0 : OP_GET_LOCAL_0) + local);
+        } else {
+            emit_bytes2(is_set ? OP_SET_LOCAL : OP_GET_LOCAL, (uint8_t)local);
+        }
+        return;
+    }
+
+    // Upvalue path
+    int upvalue = resolve_upvalue(current_compiler, &name);
+    if (upvalue != -1) {
+        if (is_set && current_compiler->upvalues[upvalue].is_const) {
+            error("Cannot reassign to a local variable marked 'const'.");
+        }
+
+        if (is_set) {
+            parse_expression();
+        }
+
+        emit_bytes2(is_set ? OP_SET_UPVALUE : OP_GET_UPVALUE, (uint8_t)upvalue);
         return;
     }
 
     // Global path
-    int global_index = identifier_constant(&name);
+    int global_index = global_slot(&name);
     bool long_instr = global_index > 255;
 
     if (is_set) {
@@ -443,11 +770,62 @@ static void named_variable(token name, bool can_assign) {
 
 static void variable(bool can_assign) { named_variable(parser.previous, can_assign); }
 
+static token synthetic_token(const char* text) {
+    token t;
+    t.start = text;
+    t.length = (int)strlen(text);
+    return t;
+}
+
+static void this_(bool can_assign) {
+    if (current_class == NULL) {
+        error("Can't use 'this' outside of a class.");
+        return;
+    }
+
+    variable(false);
+}
+
+static void super_(bool can_assign) {
+    if (current_class == NULL) {
+        error("Can't use 'super' outside of a class.");
+    } else if (!current_class->has_superclass) {
+        error("Can't use 'super' in a class with no superclass.");
+    }
+
+    consume_if_matches(TOKEN_DOT, "Expected '.' after 'super'.");
+    consume_if_matches(TOKEN_IDENTIFIER, "Expected superclass method name.");
+    int name = identifier_constant(&parser.previous);
+
+    named_variable(synthetic_token("this"), false);
+    if (matches_token(TOKEN_LEFT_PAREN)) {
+        uint8_t arg_count = argument_list();
+        named_variable(synthetic_token("super"), false);
+        emit_invoke(OP_SUPER_INVOKE, name, arg_count);
+    } else {
+        named_variable(synthetic_token("super"), false);
+        emit_constant_operand(OP_GET_SUPER, OP_GET_SUPER_LONG, name);
+    }
+}
+
 static void unary(bool can_assign) {
     token_type operator_type = parser.previous.type;
+    int operand_start = current_chunk()->count;
 
     parse_precedence(PREC_UNARY);
 
+    constant_expression operand;
+    if (constant_operand(operand_start, &operand)) {
+        if (operator_type == TOKEN_BANG) {
+            emit_folded(&operand, BOOL_VALUE(is_falsey_constant(operand.val)));
+            return;
+        }
+        if (operator_type == TOKEN_MINUS && IS_NUMBER(operand.val)) {
+            emit_folded(&operand, NUMBER_VALUE(-AS_NUMBER(operand.val)));
+            return;
+        }
+    }
+
     switch (operator_type) {
         case TOKEN_BANG: {
             emit_byte(OP_NOT);
@@ -470,9 +848,11 @@ parse_rule rules[] = {
     [TOKEN_RIGHT_PAREN] = {NULL, NULL, PREC_NONE},
     [TOKEN_LEFT_BRACE] = {NULL, NULL, PREC_NONE},
     [TOKEN_RIGHT_BRACE] = {NULL, NULL, PREC_NONE},
+    [TOKEN_LEFT_BRACKET] = {list_literal, subscript, PREC_CALL},
+    [TOKEN_RIGHT_BRACKET] = {NULL, NULL, PREC_NONE},
     [TOKEN_COLON] = {NULL, NULL, PREC_NONE},
     [TOKEN_COMMA] = {NULL, NULL, PREC_NONE},
-    [TOKEN_DOT] = {NULL, NULL, PREC_NONE},
+    [TOKEN_DOT] = {NULL, dot, PREC_CALL},
     [TOKEN_MINUS] = {unary, binary, PREC_TERM},
     [TOKEN_PLUS] = {NULL, binary, PREC_TERM},
     [TOKEN_SEMICOLON] = {NULL, NULL, PREC_NONE},
@@ -502,9 +882,9 @@ parse_rule rules[] = {
     [TOKEN_NULL] = {literal, NULL, PREC_NONE},
     [TOKEN_OR] = {NULL, or_, PREC_OR},
     [TOKEN_RETURN] = {NULL, NULL, PREC_NONE},
-    [TOKEN_SUPER] = {NULL, NULL, PREC_NONE},
+    [TOKEN_SUPER] = {super_, NULL, PREC_NONE},
     [TOKEN_SWITCH] = {NULL, NULL, PREC_NONE},
-    [TOKEN_THIS] = {NULL, NULL, PREC_NONE},
+    [TOKEN_THIS] = {this_, NULL, PREC_NONE},
     [TOKEN_TRUE] = {literal, NULL, PREC_NONE},
     [TOKEN_VAR] = {NULL, NULL, PREC_NONE},
     [TOKEN_WHILE] = {NULL, NULL, PREC_NONE},
@@ -537,21 +917,18 @@ static void parse_precedence(precedence prec) {
     }
 }
 
-static int make_constant(clox_value val) {
-    int constant = add_constant(current_chunk(), val);
+// Globals live in the VM's slot array rather than the chunk's constant table, so the same name
+// resolves to the same slot from every function and every REPL line.
+static int global_slot(token* name) {
+    object_string* str = copy_string(name->start, name->length);
+    int slot = virtual_machine_global_slot(str);
 
-    if ((unsigned int)constant >= U24T_MAX) {
-        error("Too many constants in one chunk.");
+    if ((unsigned int)slot >= U24T_MAX) {
+        error("Too many global variables.");
         return 0;
     }
 
-    return constant;
-}
-
-static int identifier_constant(token* name) {
-    object_string* str = copy_string(name->start, name->length);
-    int index = make_constant(OBJECT_VALUE(str));
-    return index;
+    return slot;
 }
 
 static bool identifiers_equal(token* a, token* b) {
@@ -576,6 +953,48 @@ static int resolve_local(compiler* comp, token* name) {
     return -1;
 }
 
+static int add_upvalue(compiler* comp, uint8_t index, bool is_local, bool is_const) {
+    int upvalue_count = comp->function->upvalue_count;
+
+    for (int i = 0; i < upvalue_count; ++i) {
+        upvalue_capture* capture = &comp->upvalues[i].capture;
+        if (capture->index == index && capture->is_local == is_local) {
+            return i;
+        }
+    }
+
+    if (upvalue_count == UINT8_COUNT) {
+        error("Too many closure variables in function.");
+        return 0;
+    }
+
+    comp->upvalues[upvalue_count] =
+        (upvalue_variable){.capture = {.index = index, .is_local = is_local}, .is_const = is_const};
+    return comp->function->upvalue_count++;
+}
+
+// Looks 'name' up in the enclosing functions, adding an upvalue for it to every function in
+// between so that each closure can hand it on to the next one in.
+static int resolve_upvalue(compiler* comp, token* name) {
+    compiler* enclosing = comp->enclosing_compiler;
+    if (enclosing == NULL) {
+        return -1;
+    }
+
+    int local = resolve_local(enclosing, name);
+    if (local != -1) {
+        enclosing->locals[local].is_captured = true;
+        return add_upvalue(comp, (uint8_t)local, true, enclosing->locals[local].is_const);
+    }
+
+    int upvalue = resolve_upvalue(enclosing, name);
+    if (upvalue != -1) {
+        return add_upvalue(comp, (uint8_t)upvalue, false, enclosing->upvalues[upvalue].is_const);
+    }
+
+    return -1;
+}
+
 static void add_local(token name, bool is_const) {
     if (current_compiler->local_count == UINT8_COUNT) {
         error("Too many local variables in function.");
@@ -586,6 +1005,7 @@ static void add_local(token name, bool is_const) {
     local->name = name;
     local->depth = -1;
     local->is_const = is_const;
+    local->is_captured = false;
 }
 
 static void declare_variable(bool is_const) {
@@ -625,8 +1045,8 @@ static int parse_variable(const char* identifier_msg, bool is_const) {
         return 0;
     }
 
-    // Add the global to the bytecode constant table.
-    return identifier_constant(&parser.previous);
+    // Resolve the global to its slot in the VM.
+    return global_slot(&parser.previous);
 }
 
 static void mark_initialized(void) {
@@ -726,8 +1146,21 @@ static void return_statement(void) {
     if (matches_token(TOKEN_SEMICOLON)) {
         emit_return();
     } else {
+        if (current_compiler->type == TYPE_INITIALIZER) {
+            error("Can't return a value from an initializer.");
+        }
+
         parse_expression();
         consume_if_matches(TOKEN_SEMICOLON, "Expected ';' after return value.");
+
+        // A call that is the last thing before the return can reuse this frame.  The OP_RETURN
+        // stays, both for jumps out of an 'and'/'or' that land on it and for natives, which
+        // OP_TAIL_CALL calls normally.
+        bytecode_chunk* chunk = current_chunk();
+        int call = current_compiler->last_call;
+        if (call >= 0 && call + 2 == chunk->count && chunk->code[call] == OP_CALL) {
+            chunk->code[call] = OP_TAIL_CALL;
+        }
         emit_byte(OP_RETURN);
     }
 }
@@ -758,7 +1191,7 @@ static void block_statement(void) {
 
 static void compile_function(function_type type) {
     compiler comp;
-    init_compiler(&comp, TYPE_FUNCTION);
+    init_compiler(&comp, type);
     begin_scope();
 
     consume_if_matches(TOKEN_LEFT_PAREN, "Expected '(' after function name.");
@@ -780,7 +1213,14 @@ static void compile_function(function_type type) {
     block_statement();
 
     object_function* function = end_compilation();
-    emit_constant(OBJECT_VALUE(function));
+
+    // A function that captures nothing needs no closure, it is called as is.
+    if (function->upvalue_count == 0) {
+        emit_constant(OBJECT_VALUE(function));
+        return;
+    }
+
+    emit_constant_operand(OP_CLOSURE, OP_CLOSURE_LONG, make_constant(OBJECT_VALUE(function)));
 }
 
 static void function_declaration(void) {
@@ -790,6 +1230,93 @@ static void function_declaration(void) {
     define_variable(global, false);
 }
 
+static void method(void) {
+    consume_if_matches(TOKEN_IDENTIFIER, "Expected method name.");
+    int constant = identifier_constant(&parser.previous);
+
+    function_type type = TYPE_METHOD;
+    if (parser.previous.length == 4 && memcmp(parser.previous.start, "init", 4) == 0) {
+        type = TYPE_INITIALIZER;
+    }
+
+    compile_function(type);
+    emit_constant_operand(OP_METHOD, OP_METHOD_LONG, constant);
+}
+
+// The class is defined before its body is compiled, so methods can refer to it by name.  A
+// superclass lives in a 'super' local for the length of the body, where closures capture it.
+static void class_declaration(void) {
+    int global = parse_variable("Expected class name.", false);
+    token class_name = parser.previous;
+    int name_constant = identifier_constant(&class_name);
+
+    emit_constant_operand(OP_CLASS, OP_CLASS_LONG, name_constant);
+    define_variable(global, false);
+
+    class_compiler class_comp;
+    class_comp.enclosing_class = current_class;
+    class_comp.has_superclass = false;
+    current_class = &class_comp;
+
+    if (matches_token(TOKEN_LESS)) {
+        consume_if_matches(TOKEN_IDENTIFIER, "Expected superclass name.");
+        variable(false);
+
+        if (identifiers_equal(&class_name, &parser.previous)) {
+            error("A class can't inherit from itself.");
+        }
+
+        begin_scope();
+        add_local(synthetic_token("super"), true);
+        define_variable(0, true);
+
+        named_variable(class_name, false);
+        emit_byte(OP_INHERIT);
+        class_comp.has_superclass = true;
+    }
+
+    named_variable(class_name, false);
+    consume_if_matches(TOKEN_LEFT_BRACE, "Expected '{' before class body.");
+    while (!check_token(TOKEN_RIGHT_BRACE) && !check_token(TOKEN_EOF)) {
+        method();
+    }
+    consume_if_matches(TOKEN_RIGHT_BRACE, "Expected '}' after class body.");
+    emit_byte(OP_POP);
+
+    if (class_comp.has_superclass) {
+        end_scope();
+    }
+
+    current_class = current_class->enclosing_class;
+}
+
+// Whether the case label just compiled from 'start' is a number or string known at compile time,
+// the only kinds of label an OP_SWITCH table can hold.
+static bool table_label(int start, clox_value* key) {
+    constant_expression label;
+    if (!constant_operand(start, &label) || !(IS_NUMBER(label.val) || IS_STRING(label.val))) {
+        return false;
+    }
+
+    *key = label.val;
+    return true;
+}
+
+static int* add_end_jump(int* end_jumps, int* count, int* capacity) {
+    if (*count >= *capacity) {
+        int old_capacity = *capacity;
+        *capacity = GROW_CAPACITY(old_capacity);
+        end_jumps = GROW_ARRAY(int, end_jumps, old_capacity, *capacity);
+    }
+
+    end_jumps[(*count)++] = emit_jump(OP_JUMP);
+    return end_jumps;
+}
+
+// Cases are compared in order until one matches, but constant labels can't have side effects, so a
+// run of them at the top is looked up all at once in a table by OP_SWITCH.  It leaves the value on
+// the stack just like the comparisons do and jumps straight to the matching body, or on a miss to
+// the first case whose label has to be evaluated, the default or the end.
 static void switch_statement(void) {
     consume_if_matches(TOKEN_LEFT_PAREN, "Expected '(' after switch statement.");
     parse_expression();
@@ -800,14 +1327,56 @@ static void switch_statement(void) {
     // We need an array of jump points, since we don't know which case will end up matching.  Each
     // one of the possible cases, if matched, needs to jump past the 'default' case.  Since we don't
     // know what this will be, we need to keep an array of them and patch all of them.
-    int end_jumps[UINT8_COUNT];
+    int* end_jumps = NULL;
     int end_jump_count = 0;
+    int end_jump_capacity = 0;
+
+    switch_case* cases = NULL;
+    int case_count = 0;
+    int case_capacity = 0;
+    int table = -1;
+    int miss = -1;
 
     while (matches_token(TOKEN_CASE)) {
         // Duplicate the expression at the bottom of the stack every time we find a case, since it
         // will be eaten by the EQUAL opcode.
+        int case_start = current_chunk()->count;
         emit_byte(OP_DUP);
+        int label_start = current_chunk()->count;
         parse_expression();
+
+        clox_value key;
+        if (miss < 0 && table_label(label_start, &key)) {
+            // The label's constant is left in the chunk, which keeps it alive for the table.
+            rewind_bytecode_chunk(current_chunk(), case_start, current_chunk()->constants.count);
+            current_compiler->last_constant.valid = false;
+
+            if (table < 0) {
+                table = add_switch_table(current_chunk());
+                if (table > UINT16_MAX) {
+                    error("Too many switch statements in one function.");
+                }
+                emit_bytes3(OP_SWITCH, (table >> 8) & 0xFF, table & 0xFF);
+            }
+
+            if (case_count >= case_capacity) {
+                int old_capacity = case_capacity;
+                case_capacity = GROW_CAPACITY(old_capacity);
+                cases = GROW_ARRAY(switch_case, cases, old_capacity, case_capacity);
+            }
+            cases[case_count++] = (switch_case){.key = key, .target = current_chunk()->count};
+
+            consume_if_matches(TOKEN_COLON, "Expected ':' after case expression.");
+            statement();
+            end_jumps = add_end_jump(end_jumps, &end_jump_count, &end_jump_capacity);
+            continue;
+        }
+
+        // From the first label that has to be evaluated on, every case is compared in turn.
+        if (miss < 0) {
+            miss = case_start;
+        }
+
         emit_byte(OP_EQUAL);
 
         // If false, we jump over the body of the case.  Otherwise we fall through.
@@ -816,18 +1385,17 @@ static void switch_statement(void) {
         emit_byte(OP_POP);
         consume_if_matches(TOKEN_COLON, "Expected ':' after case expression.");
         statement();
-
-        if (end_jump_count == UINT8_COUNT) {
-            error("Cannot have more than 255 cases in switch statement.");
-            return;
-        }
-
-        end_jumps[end_jump_count++] = emit_jump(OP_JUMP);
+        end_jumps = add_end_jump(end_jumps, &end_jump_count, &end_jump_capacity);
 
         patch_jump(next_case);
         emit_byte(OP_POP);
     }
 
+    if (miss < 0) {
+        miss = current_chunk()->count;
+        current_compiler->last_constant.valid = false;
+    }
+
     if (matches_token(TOKEN_DEFAULT)) {
         consume_if_matches(TOKEN_COLON, "Expected ':' after default.");
         statement();
@@ -837,8 +1405,15 @@ static void switch_statement(void) {
         patch_jump(end_jumps[i]);
     }
 
+    if (table >= 0) {
+        build_switch_table(&current_chunk()->switch_tables[table], cases, case_count, miss);
+    }
+
     emit_byte(OP_POP);
     consume_if_matches(TOKEN_RIGHT_BRACE, "Expected '}' to end switch body.");
+
+    FREE_ARRAY(int, end_jumps, end_jump_capacity);
+    FREE_ARRAY(switch_case, cases, case_capacity);
 }
 
 static void expression_statement(void) {
@@ -975,7 +1550,9 @@ static void synchronize(void) {
 }
 
 static void declaration_statement(void) {
-    if (matches_token(TOKEN_FUNC)) {
+    if (matches_token(TOKEN_CLASS)) {
+        class_declaration();
+    } else if (matches_token(TOKEN_FUNC)) {
         function_declaration();
     } else if (matches_token(TOKEN_VAR)) {
         variable_declaration(false);
@@ -1033,3 +1610,13 @@ object_function* compile(const char* source_code) {
     object_function* function = end_compilation();
     return parser.had_error ? NULL : function;
 }
+
+void set_compiler_optimization(bool enabled) { optimize_bytecode = enabled; }
+
+void mark_compiler_roots(void) {
+    compiler* comp = current_compiler;
+    while (comp != NULL) {
+        mark_object((object*)comp->function);
+        comp = comp->enclosing_compiler;
+    }
+}
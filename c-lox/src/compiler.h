@@ -4,5 +4,7 @@
 #include "clox_object.h"
 
 object_function* compile(const char* source_code);
+void mark_compiler_roots(void);
+void set_compiler_optimization(bool enabled);
 
 #endif
@@ -1,6 +1,7 @@
 #include "disassembler.h"
 #include "bytecode_chunk.h"
 #include "clox_value.h"
+#include "virtual_machine.h"
 #include <stdio.h>
 #include <stdlib.h>
 
@@ -34,6 +35,23 @@ static int constant_instruction(const char* name, bytecode_chunk* chunk, int off
     return is_long_instr ? offset + 4 : offset + 2;
 }
 
+static int global_instruction(const char* name, bytecode_chunk* chunk, int offset,
+                              bool is_long_instr) {
+    int slot;
+    if (is_long_instr) {
+        uint8_t hi = chunk->code[offset + 1];
+        uint8_t mid = chunk->code[offset + 2];
+        uint8_t lo = chunk->code[offset + 3];
+        slot = deconstruct_u24_t((u24_t){.hi = hi, .mid = mid, .lo = lo});
+    } else {
+        slot = chunk->code[offset + 1];
+    }
+    printf("%-24s %6d '", name, slot);
+    print_string(vm.globals[slot].name);
+    printf("'\n");
+    return is_long_instr ? offset + 4 : offset + 2;
+}
+
 static int simple_instruction(const char* name, int offset) {
     printf("%s\n", name);
     return offset + 1;
@@ -52,6 +70,80 @@ static int jump_instruction(const char* name, int sign, bytecode_chunk* chunk, i
     return offset + 3;
 }
 
+static int local_constant_instruction(const char* name, bytecode_chunk* chunk, int offset) {
+    uint8_t slot = chunk->code[offset + 1];
+    uint8_t constant = chunk->code[offset + 2];
+    printf("%-24s %d %6d '", name, slot, constant);
+    print_value(chunk->constants.values[constant]);
+    printf("'\n");
+    return offset + 3;
+}
+
+static int long_jump_instruction(const char* name, int sign, bytecode_chunk* chunk, int offset) {
+    uint8_t hi = chunk->code[offset + 1];
+    uint8_t mid = chunk->code[offset + 2];
+    uint8_t lo = chunk->code[offset + 3];
+    int jump = deconstruct_u24_t((u24_t){.hi = hi, .mid = mid, .lo = lo});
+    printf("%-24s %6d -> %d\n", name, offset, offset + 4 + sign * jump);
+    return offset + 4;
+}
+
+static int closure_instruction(const char* name, bytecode_chunk* chunk, int offset,
+                               bool is_long_instr) {
+    int next = constant_instruction(name, chunk, offset, is_long_instr);
+    int constant = is_long_instr ? deconstruct_u24_t((u24_t){.hi = chunk->code[offset + 1],
+                                                             .mid = chunk->code[offset + 2],
+                                                             .lo = chunk->code[offset + 3]})
+                                 : chunk->code[offset + 1];
+
+    object_function* function = AS_FUNCTION(chunk->constants.values[constant]);
+    for (int i = 0; i < function->upvalue_count; ++i) {
+        upvalue_capture* capture = &function->captures[i];
+        printf("%-31s | %s %d\n", "", capture->is_local ? "local" : "upvalue", capture->index);
+    }
+    return next;
+}
+
+// Prints the index of the instruction's inline cache and the property it accesses.
+static int property_instruction(const char* name, bytecode_chunk* chunk, int offset) {
+    int index = (chunk->code[offset + 1] << 8) | chunk->code[offset + 2];
+    printf("%-24s %6d '", name, index);
+    print_string(chunk->property_caches[index].name);
+    printf("'\n");
+    return offset + 3;
+}
+
+// Prints the index of the instruction's method cache, the method it calls and the argument count.
+static int invoke_instruction(const char* name, bytecode_chunk* chunk, int offset) {
+    int index = (chunk->code[offset + 1] << 8) | chunk->code[offset + 2];
+    uint8_t arg_count = chunk->code[offset + 3];
+    printf("%-24s %6d '", name, index);
+    print_string(chunk->method_caches[index].name);
+    printf("' (%d args)\n", arg_count);
+    return offset + 4;
+}
+
+static int switch_instruction(const char* name, bytecode_chunk* chunk, int offset) {
+    int index = (chunk->code[offset + 1] << 8) | chunk->code[offset + 2];
+    switch_table* table = &chunk->switch_tables[index];
+    printf("%-24s %6d %s\n", name, index, table->dense ? "dense" : "hashed");
+
+    for (int i = 0; i < table->capacity; ++i) {
+        if (table->targets[i] < 0) {
+            continue;
+        }
+        printf("%-31s | ", "");
+        if (table->dense) {
+            print_value(NUMBER_VALUE(table->min + i));
+        } else {
+            print_value(table->keys[i]);
+        }
+        printf(" -> %d\n", table->targets[i]);
+    }
+    printf("%-31s | miss -> %d\n", "", table->miss);
+    return offset + 3;
+}
+
 int disassemble_instruction(bytecode_chunk* chunk, int offset) {
     printf("%06d ", offset);
 
@@ -82,28 +174,72 @@ int disassemble_instruction(bytecode_chunk* chunk, int offset) {
             return byte_instruction("OP_GET_LOCAL", chunk, offset);
         case OP_SET_LOCAL:
             return byte_instruction("OP_SET_LOCAL", chunk, offset);
+        case OP_GET_LOCAL_0:
+            return simple_instruction("OP_GET_LOCAL_0", offset);
+        case OP_GET_LOCAL_1:
+            return simple_instruction("OP_GET_LOCAL_1", offset);
+        case OP_GET_LOCAL_2:
+            return simple_instruction("OP_GET_LOCAL_2", offset);
+        case OP_GET_LOCAL_3:
+            return simple_instruction("OP_GET_LOCAL_3", offset);
+        case OP_SET_LOCAL_0:
+            return simple_instruction("OP_SET_LOCAL_0", offset);
+        case OP_SET_LOCAL_1:
+            return simple_instruction("OP_SET_LOCAL_1", offset);
+        case OP_SET_LOCAL_2:
+            return simple_instruction("OP_SET_LOCAL_2", offset);
+        case OP_SET_LOCAL_3:
+            return simple_instruction("OP_SET_LOCAL_3", offset);
         case OP_GET_GLOBAL:
-            return constant_instruction("OP_GET_GLOBAL", chunk, offset, false);
+            return global_instruction("OP_GET_GLOBAL", chunk, offset, false);
         case OP_GET_GLOBAL_LONG:
-            return constant_instruction("OP_GET_GLOBAL", chunk, offset, true);
+            return global_instruction("OP_GET_GLOBAL_LONG", chunk, offset, true);
         case OP_DEFINE_GLOBAL:
-            return constant_instruction("OP_DEFINE_GLOBAL", chunk, offset, false);
+            return global_instruction("OP_DEFINE_GLOBAL", chunk, offset, false);
         case OP_DEFINE_GLOBAL_CONST:
-            return constant_instruction("OP_DEFINE_GLOBAL_CONST", chunk, offset, false);
+            return global_instruction("OP_DEFINE_GLOBAL_CONST", chunk, offset, false);
         case OP_DEFINE_GLOBAL_LONG:
-            return constant_instruction("OP_DEFINE_GLOBAL_LONG", chunk, offset, true);
+            return global_instruction("OP_DEFINE_GLOBAL_LONG", chunk, offset, true);
         case OP_DEFINE_GLOBAL_LONG_CONST:
-            return constant_instruction("OP_DEFINE_GLOBAL_LONG_CONST", chunk, offset, true);
+            return global_instruction("OP_DEFINE_GLOBAL_LONG_CONST", chunk, offset, true);
         case OP_SET_GLOBAL:
-            return constant_instruction("OP_SET_GLOBAL", chunk, offset, false);
+            return global_instruction("OP_SET_GLOBAL", chunk, offset, false);
         case OP_SET_GLOBAL_LONG:
-            return constant_instruction("OP_SET_GLOBAL", chunk, offset, false);
+            return global_instruction("OP_SET_GLOBAL_LONG", chunk, offset, true);
+        case OP_GET_UPVALUE:
+            return byte_instruction("OP_GET_UPVALUE", chunk, offset);
+        case OP_SET_UPVALUE:
+            return byte_instruction("OP_SET_UPVALUE", chunk, offset);
+        case OP_GET_PROPERTY:
+            return property_instruction("OP_GET_PROPERTY", chunk, offset);
+        case OP_SET_PROPERTY:
+            return property_instruction("OP_SET_PROPERTY", chunk, offset);
+        case OP_GET_SUPER:
+            return constant_instruction("OP_GET_SUPER", chunk, offset, false);
+        case OP_GET_SUPER_LONG:
+            return constant_instruction("OP_GET_SUPER_LONG", chunk, offset, true);
+        case OP_INVOKE:
+            return invoke_instruction("OP_INVOKE", chunk, offset);
+        case OP_SUPER_INVOKE:
+            return invoke_instruction("OP_SUPER_INVOKE", chunk, offset);
+        case OP_LIST:
+            return byte_instruction("OP_LIST", chunk, offset);
+        case OP_GET_INDEX:
+            return simple_instruction("OP_GET_INDEX", offset);
+        case OP_SET_INDEX:
+            return simple_instruction("OP_SET_INDEX", offset);
         case OP_EQUAL:
             return simple_instruction("OP_EQUAL", offset);
         case OP_GREATER:
             return simple_instruction("OP_GREATER", offset);
         case OP_LESS:
             return simple_instruction("OP_LESS", offset);
+        case OP_NOT_EQUAL:
+            return simple_instruction("OP_NOT_EQUAL", offset);
+        case OP_GREATER_EQUAL:
+            return simple_instruction("OP_GREATER_EQUAL", offset);
+        case OP_LESS_EQUAL:
+            return simple_instruction("OP_LESS_EQUAL", offset);
         case OP_ADD:
             return simple_instruction("OP_ADD", offset);
         case OP_SUBTRACT:
@@ -118,14 +254,64 @@ int disassemble_instruction(bytecode_chunk* chunk, int offset) {
             return simple_instruction("OP_NEGATE", offset);
         case OP_JUMP:
             return jump_instruction("OP_JUMP", 1, chunk, offset);
+        case OP_JUMP_LONG:
+            return long_jump_instruction("OP_JUMP_LONG", 1, chunk, offset);
         case OP_JUMP_IF_FALSE:
             return jump_instruction("OP_JUMP_IF_FALSE", 1, chunk, offset);
+        case OP_JUMP_IF_FALSE_LONG:
+            return long_jump_instruction("OP_JUMP_IF_FALSE_LONG", 1, chunk, offset);
+        case OP_POP_JUMP_IF_FALSE:
+            return jump_instruction("OP_POP_JUMP_IF_FALSE", 1, chunk, offset);
         case OP_LOOP:
             return jump_instruction("OP_LOOP", -1, chunk, offset);
+        case OP_LOOP_LONG:
+            return long_jump_instruction("OP_LOOP_LONG", -1, chunk, offset);
         case OP_CALL:
             return byte_instruction("OP_CALL", chunk, offset);
+        case OP_TAIL_CALL:
+            return byte_instruction("OP_TAIL_CALL", chunk, offset);
         case OP_RETURN:
             return simple_instruction("OP_RETURN", offset);
+        case OP_CLOSURE:
+            return closure_instruction("OP_CLOSURE", chunk, offset, false);
+        case OP_CLOSURE_LONG:
+            return closure_instruction("OP_CLOSURE_LONG", chunk, offset, true);
+        case OP_CLOSE_UPVALUE:
+            return simple_instruction("OP_CLOSE_UPVALUE", offset);
+        case OP_CLASS:
+            return constant_instruction("OP_CLASS", chunk, offset, false);
+        case OP_CLASS_LONG:
+            return constant_instruction("OP_CLASS_LONG", chunk, offset, true);
+        case OP_METHOD:
+            return constant_instruction("OP_METHOD", chunk, offset, false);
+        case OP_METHOD_LONG:
+            return constant_instruction("OP_METHOD_LONG", chunk, offset, true);
+        case OP_INHERIT:
+            return simple_instruction("OP_INHERIT", offset);
+        case OP_SWITCH:
+            return switch_instruction("OP_SWITCH", chunk, offset);
+        case OP_GET_LOCAL_CONSTANT:
+            return local_constant_instruction("OP_GET_LOCAL_CONSTANT", chunk, offset);
+        case OP_SET_LOCAL_POP:
+            return byte_instruction("OP_SET_LOCAL_POP", chunk, offset);
+        case OP_SET_GLOBAL_POP:
+            return global_instruction("OP_SET_GLOBAL_POP", chunk, offset, false);
+        case OP_EQUAL_JUMP_IF_FALSE:
+            return jump_instruction("OP_EQUAL_JUMP_IF_FALSE", 1, chunk, offset);
+        case OP_NOT_EQUAL_JUMP_IF_FALSE:
+            return jump_instruction("OP_NOT_EQUAL_JUMP_IF_FALSE", 1, chunk, offset);
+        case OP_GREATER_JUMP_IF_FALSE:
+            return jump_instruction("OP_GREATER_JUMP_IF_FALSE", 1, chunk, offset);
+        case OP_LESS_JUMP_IF_FALSE:
+            return jump_instruction("OP_LESS_JUMP_IF_FALSE", 1, chunk, offset);
+        case OP_ADD_NUM:
+            return simple_instruction("OP_ADD_NUM", offset);
+        case OP_EQUAL_NUM:
+            return simple_instruction("OP_EQUAL_NUM", offset);
+        case OP_NOT_EQUAL_NUM:
+            return simple_instruction("OP_NOT_EQUAL_NUM", offset);
+        case OP_GET_GLOBAL_DEFINED:
+            return global_instruction("OP_GET_GLOBAL_DEFINED", chunk, offset, false);
         case OP_DEBUG:
             return simple_instruction("OP_DEBUG", offset);
         default: {
@@ -134,3 +320,168 @@ int disassemble_instruction(bytecode_chunk* chunk, int offset) {
         }
     }
 }
+
+const char* opcode_name(uint8_t op) {
+    switch (op) {
+        case OP_CONSTANT:
+            return "OP_CONSTANT";
+        case OP_CONSTANT_LONG:
+            return "OP_CONSTANT_LONG";
+        case OP_NULL:
+            return "OP_NULL";
+        case OP_TRUE:
+            return "OP_TRUE";
+        case OP_FALSE:
+            return "OP_FALSE";
+        case OP_POP:
+            return "OP_POP";
+        case OP_DUP:
+            return "OP_DUP";
+        case OP_GET_LOCAL:
+            return "OP_GET_LOCAL";
+        case OP_SET_LOCAL:
+            return "OP_SET_LOCAL";
+        case OP_GET_LOCAL_0:
+            return "OP_GET_LOCAL_0";
+        case OP_GET_LOCAL_1:
+            return "OP_GET_LOCAL_1";
+        case OP_GET_LOCAL_2:
+            return "OP_GET_LOCAL_2";
+        case OP_GET_LOCAL_3:
+            return "OP_GET_LOCAL_3";
+        case OP_SET_LOCAL_0:
+            return "OP_SET_LOCAL_0";
+        case OP_SET_LOCAL_1:
+            return "OP_SET_LOCAL_1";
+        case OP_SET_LOCAL_2:
+            return "OP_SET_LOCAL_2";
+        case OP_SET_LOCAL_3:
+            return "OP_SET_LOCAL_3";
+        case OP_GET_GLOBAL:
+            return "OP_GET_GLOBAL";
+        case OP_GET_GLOBAL_LONG:
+            return "OP_GET_GLOBAL_LONG";
+        case OP_DEFINE_GLOBAL:
+            return "OP_DEFINE_GLOBAL";
+        case OP_DEFINE_GLOBAL_CONST:
+            return "OP_DEFINE_GLOBAL_CONST";
+        case OP_DEFINE_GLOBAL_LONG:
+            return "OP_DEFINE_GLOBAL_LONG";
+        case OP_DEFINE_GLOBAL_LONG_CONST:
+            return "OP_DEFINE_GLOBAL_LONG_CONST";
+        case OP_SET_GLOBAL:
+            return "OP_SET_GLOBAL";
+        case OP_SET_GLOBAL_LONG:
+            return "OP_SET_GLOBAL_LONG";
+        case OP_GET_UPVALUE:
+            return "OP_GET_UPVALUE";
+        case OP_SET_UPVALUE:
+            return "OP_SET_UPVALUE";
+        case OP_GET_PROPERTY:
+            return "OP_GET_PROPERTY";
+        case OP_SET_PROPERTY:
+            return "OP_SET_PROPERTY";
+        case OP_GET_SUPER:
+            return "OP_GET_SUPER";
+        case OP_GET_SUPER_LONG:
+            return "OP_GET_SUPER_LONG";
+        case OP_INVOKE:
+            return "OP_INVOKE";
+        case OP_SUPER_INVOKE:
+            return "OP_SUPER_INVOKE";
+        case OP_LIST:
+            return "OP_LIST";
+        case OP_GET_INDEX:
+            return "OP_GET_INDEX";
+        case OP_SET_INDEX:
+            return "OP_SET_INDEX";
+        case OP_EQUAL:
+            return "OP_EQUAL";
+        case OP_GREATER:
+            return "OP_GREATER";
+        case OP_LESS:
+            return "OP_LESS";
+        case OP_NOT_EQUAL:
+            return "OP_NOT_EQUAL";
+        case OP_GREATER_EQUAL:
+            return "OP_GREATER_EQUAL";
+        case OP_LESS_EQUAL:
+            return "OP_LESS_EQUAL";
+        case OP_ADD:
+            return "OP_ADD";
+        case OP_SUBTRACT:
+            return "OP_SUBTRACT";
+        case OP_MULTIPLY:
+            return "OP_MULTIPLY";
+        case OP_DIVIDE:
+            return "OP_DIVIDE";
+        case OP_NOT:
+            return "OP_NOT";
+        case OP_NEGATE:
+            return "OP_NEGATE";
+        case OP_JUMP:
+            return "OP_JUMP";
+        case OP_JUMP_LONG:
+            return "OP_JUMP_LONG";
+        case OP_JUMP_IF_FALSE:
+            return "OP_JUMP_IF_FALSE";
+        case OP_JUMP_IF_FALSE_LONG:
+            return "OP_JUMP_IF_FALSE_LONG";
+        case OP_POP_JUMP_IF_FALSE:
+            return "OP_POP_JUMP_IF_FALSE";
+        case OP_LOOP:
+            return "OP_LOOP";
+        case OP_LOOP_LONG:
+            return "OP_LOOP_LONG";
+        case OP_CALL:
+            return "OP_CALL";
+        case OP_TAIL_CALL:
+            return "OP_TAIL_CALL";
+        case OP_RETURN:
+            return "OP_RETURN";
+        case OP_CLOSURE:
+            return "OP_CLOSURE";
+        case OP_CLOSURE_LONG:
+            return "OP_CLOSURE_LONG";
+        case OP_CLOSE_UPVALUE:
+            return "OP_CLOSE_UPVALUE";
+        case OP_CLASS:
+            return "OP_CLASS";
+        case OP_CLASS_LONG:
+            return "OP_CLASS_LONG";
+        case OP_METHOD:
+            return "OP_METHOD";
+        case OP_METHOD_LONG:
+            return "OP_METHOD_LONG";
+        case OP_INHERIT:
+            return "OP_INHERIT";
+        case OP_SWITCH:
+            return "OP_SWITCH";
+        case OP_GET_LOCAL_CONSTANT:
+            return "OP_GET_LOCAL_CONSTANT";
+        case OP_SET_LOCAL_POP:
+            return "OP_SET_LOCAL_POP";
+        case OP_SET_GLOBAL_POP:
+            return "OP_SET_GLOBAL_POP";
+        case OP_EQUAL_JUMP_IF_FALSE:
+            return "OP_EQUAL_JUMP_IF_FALSE";
+        case OP_NOT_EQUAL_JUMP_IF_FALSE:
+            return "OP_NOT_EQUAL_JUMP_IF_FALSE";
+        case OP_GREATER_JUMP_IF_FALSE:
+            return "OP_GREATER_JUMP_IF_FALSE";
+        case OP_LESS_JUMP_IF_FALSE:
+            return "OP_LESS_JUMP_IF_FALSE";
+        case OP_ADD_NUM:
+            return "OP_ADD_NUM";
+        case OP_EQUAL_NUM:
+            return "OP_EQUAL_NUM";
+        case OP_NOT_EQUAL_NUM:
+            return "OP_NOT_EQUAL_NUM";
+        case OP_GET_GLOBAL_DEFINED:
+            return "OP_GET_GLOBAL_DEFINED";
+        case OP_DEBUG:
+            return "OP_DEBUG";
+        default:
+            return "OP_UNKNOWN";
+    }
+}
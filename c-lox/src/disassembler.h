@@ -4,5 +4,6 @@
 
 void disassemble_chunk(bytecode_chunk* chunk, const char* name);
 int disassemble_instruction(bytecode_chunk* chunk, int offset);
+const char* opcode_name(uint8_t op);
 
 #endif
@@ -1,100 +1,257 @@
 #include "hash_table.h"
+#include "clox_object.h"
+#include "virtual_machine.h"
+#include <stdio.h>
 #include <string.h>
 
-#define HASH_TABLE_MAX_LOAD 0.75
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#define HASH_TABLE_MAX_LOAD 0.875
+// A table whose live entries drop under this share of its capacity is shrunk on the next insert.
+#define HASH_TABLE_MIN_LOAD 0.125
+
+#define CONTROL_EMPTY ((uint8_t)0x80)
+#define CONTROL_DELETED ((uint8_t)0xFE)
+
+// The high bits of the hash pick the first group to probe and the low 7 bits are stored in the
+// control byte, so a full slot's control byte never has its top bit set.
+#define HASH_GROUP(hash) ((hash) >> 7)
+#define HASH_TAG(hash) ((uint8_t)((hash) & 0x7F))
 
 void init_hash_table(hash_table* table) {
     table->count = 0;
+    table->tombstones = 0;
     table->capacity = 0;
     table->entries = NULL;
+    table->control = NULL;
+    table->owner = NULL;
 }
 
 void free_hash_table(hash_table* table) {
     FREE_ARRAY(table_entry, table->entries, table->capacity);
+    FREE_ARRAY(uint8_t, table->control, table->capacity);
     init_hash_table(table);
 }
 
-static table_entry* find_entry(table_entry* entries, int capacity, object_string* key) {
-    uint32_t index = key->hash % capacity;
-    table_entry* tombstone = NULL;
+// Each of these returns a bitmask with bit i set when control byte i of the group matches.
+#ifdef __SSE2__
+static inline uint32_t group_match(const uint8_t* group, uint8_t tag) {
+    __m128i control = _mm_loadu_si128((const __m128i*)group);
+    return (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(control, _mm_set1_epi8((char)tag)));
+}
 
-    while (true) {
-        table_entry* entry = &entries[index];
+// Empty and deleted slots are the only ones with the top bit set.
+static inline uint32_t group_match_free(const uint8_t* group) {
+    return (uint32_t)_mm_movemask_epi8(_mm_loadu_si128((const __m128i*)group));
+}
+#else
+static inline uint32_t group_match(const uint8_t* group, uint8_t tag) {
+    uint32_t mask = 0;
+    for (int i = 0; i < HASH_TABLE_GROUP_WIDTH; ++i) {
+        mask |= (uint32_t)(group[i] == tag) << i;
+    }
+    return mask;
+}
 
-        if (entry->key == NULL) {
-            if (IS_NULL(entry->val)) {
-                // Empty entry
-                return tombstone != NULL ? tombstone : entry;
-            } else {
-                // We found a tombstone
-                if (tombstone == NULL) {
-                    tombstone = entry;
-                }
+static inline uint32_t group_match_free(const uint8_t* group) {
+    uint32_t mask = 0;
+    for (int i = 0; i < HASH_TABLE_GROUP_WIDTH; ++i) {
+        mask |= (uint32_t)(group[i] >> 7) << i;
+    }
+    return mask;
+}
+#endif
+
+static inline int lowest_bit(uint32_t mask) {
+#ifdef __GNUC__
+    return __builtin_ctz(mask);
+#else
+    int bit = 0;
+    while ((mask & 1) == 0) {
+        mask >>= 1;
+        ++bit;
+    }
+    return bit;
+#endif
+}
+
+// Groups are probed triangularly (+1, +2, +3, ...), which visits every group exactly once when the
+// group count is a power of two.  A lookup can stop at the first group that still has an EMPTY
+// slot, because an insert would never have skipped past it.
+#define FOR_EACH_PROBE_GROUP(capacity, hash, group)                                                \
+    for (uint32_t group_mask_ = (uint32_t)(capacity) / HASH_TABLE_GROUP_WIDTH - 1,                 \
+                  group = HASH_GROUP(hash) & group_mask_, step_ = 1;                               \
+         ; group = (group + step_++) & group_mask_)
+
+// Returns the slot holding 'key', or -1.
+static int find_slot(const hash_table* table, object_string* key) {
+    uint8_t tag = HASH_TAG(key->hash);
+
+    FOR_EACH_PROBE_GROUP(table->capacity, key->hash, group) {
+        const uint8_t* control = &table->control[group * HASH_TABLE_GROUP_WIDTH];
+
+        for (uint32_t matches = group_match(control, tag); matches != 0; matches &= matches - 1) {
+            int slot = (int)group * HASH_TABLE_GROUP_WIDTH + lowest_bit(matches);
+            if (table->entries[slot].key == key) {
+                return slot;
             }
-        } else if (entry->key == key) {
-            return entry;
         }
 
-        index = (index + 1) % capacity;
+        if (group_match(control, CONTROL_EMPTY) != 0) {
+            return -1;
+        }
+    }
+}
+
+// Returns the first empty or deleted slot on the probe sequence for 'hash'.
+static int find_free_slot(const uint8_t* control, int capacity, uint32_t hash) {
+    FOR_EACH_PROBE_GROUP(capacity, hash, group) {
+        uint32_t free_slots = group_match_free(&control[group * HASH_TABLE_GROUP_WIDTH]);
+        if (free_slots != 0) {
+            return (int)group * HASH_TABLE_GROUP_WIDTH + lowest_bit(free_slots);
+        }
     }
 }
 
 static void adjust_capacity(hash_table* table, int capacity) {
+    // Both allocations can collect, which may delete from the old table, so only read it after.
     table_entry* entries = ALLOCATE(table_entry, capacity);
+    uint8_t* control = ALLOCATE(uint8_t, capacity);
+    memset(control, CONTROL_EMPTY, capacity);
     for (int i = 0; i < capacity; ++i) {
         entries[i].key = NULL;
         entries[i].val = NULL_VALUE;
     }
 
+    // Rehashing drops every tombstone.
     table->count = 0;
+    table->tombstones = 0;
     for (int i = 0; i < table->capacity; ++i) {
         table_entry* entry = &table->entries[i];
         if (entry->key == NULL) {
             continue;
         }
 
-        // Rehash the old entries into their new position
-        table_entry* destination = find_entry(entries, capacity, entry->key);
-        destination->key = entry->key;
-        destination->val = entry->val;
+        int slot = find_free_slot(control, capacity, entry->key->hash);
+        control[slot] = HASH_TAG(entry->key->hash);
+        entries[slot] = *entry;
         ++table->count;
     }
 
     FREE_ARRAY(table_entry, table->entries, table->capacity);
+    FREE_ARRAY(uint8_t, table->control, table->capacity);
     table->entries = entries;
+    table->control = control;
     table->capacity = capacity;
 }
 
+// Reinserts every entry without allocating, which clears out all tombstones.  Full slots are
+// first flagged DELETED to mean "not placed yet", then each one is moved to the first free slot
+// of its probe sequence, swapping with any unplaced entry found there.
+static void rehash_in_place(hash_table* table) {
+    uint8_t* control = table->control;
+    table_entry* entries = table->entries;
+
+    for (int i = 0; i < table->capacity; ++i) {
+        control[i] = (control[i] & CONTROL_EMPTY) ? CONTROL_EMPTY : CONTROL_DELETED;
+    }
+
+    for (int i = 0; i < table->capacity; ++i) {
+        while (control[i] == CONTROL_DELETED) {
+            uint32_t hash = entries[i].key->hash;
+            int target = find_free_slot(control, table->capacity, hash);
+
+            // Already in the first group with room, which is where a lookup will look.
+            if (target / HASH_TABLE_GROUP_WIDTH == i / HASH_TABLE_GROUP_WIDTH) {
+                control[i] = HASH_TAG(hash);
+                break;
+            }
+
+            if (control[target] == CONTROL_EMPTY) {
+                entries[target] = entries[i];
+                control[target] = HASH_TAG(hash);
+                entries[i].key = NULL;
+                entries[i].val = NULL_VALUE;
+                control[i] = CONTROL_EMPTY;
+                break;
+            }
+
+            // The target holds an entry that still has to be placed, so swap and place it next.
+            table_entry displaced = entries[target];
+            entries[target] = entries[i];
+            control[target] = HASH_TAG(hash);
+            entries[i] = displaced;
+        }
+    }
+
+    table->tombstones = 0;
+}
+
+// The smallest capacity that holds 'count' keys at no more than half the maximum load.
+static int capacity_for(int count) {
+    int capacity = HASH_TABLE_GROUP_WIDTH;
+    while (count > capacity * (HASH_TABLE_MAX_LOAD / 2)) {
+        capacity *= 2;
+    }
+    return capacity;
+}
+
+// Makes sure one more key fits.  Tables that have mostly emptied out are shrunk, and tombstones
+// are cleared in place once there are enough of them instead of letting them force a resize.
+static void make_room(hash_table* table) {
+    int count = table->count + 1;
+
+    if (table->capacity > HASH_TABLE_GROUP_WIDTH && count < table->capacity * HASH_TABLE_MIN_LOAD) {
+        adjust_capacity(table, capacity_for(count));
+        return;
+    }
+
+    if (table->tombstones > 0 &&
+        table->tombstones * 100 >= table->capacity * CLOX_TABLE_TOMBSTONE_PERCENT) {
+        rehash_in_place(table);
+    }
+
+    if (count + table->tombstones > table->capacity * HASH_TABLE_MAX_LOAD) {
+        adjust_capacity(table, capacity_for(count));
+    }
+}
+
 bool hash_table_get(hash_table* table, object_string* key, clox_value* val) {
     if (table->count == 0) {
         return false;
     }
 
-    table_entry* entry = find_entry(table->entries, table->capacity, key);
-    if (entry->key == NULL) {
+    int slot = find_slot(table, key);
+    if (slot < 0) {
         return false;
     }
 
-    *val = entry->val;
+    *val = table->entries[slot].val;
     return true;
 }
 
 bool hash_table_set(hash_table* table, object_string* key, clox_value val) {
-    if (table->count >= table->capacity * HASH_TABLE_MAX_LOAD) {
-        int capacity = GROW_CAPACITY(table->capacity);
-        adjust_capacity(table, capacity);
-    }
+    int slot = table->count == 0 ? -1 : find_slot(table, key);
+    bool is_new_key = slot < 0;
 
-    table_entry* entry = find_entry(table->entries, table->capacity, key);
-    bool is_new_key = entry->key == NULL;
+    if (is_new_key) {
+        make_room(table);
 
-    // Only increment the count if it's truly a new entry and not a tombstone.
-    if (is_new_key && IS_NULL(entry->val)) {
+        slot = find_free_slot(table->control, table->capacity, key->hash);
+        if (table->control[slot] == CONTROL_DELETED) {
+            --table->tombstones;
+        }
+        table->control[slot] = HASH_TAG(key->hash);
         ++table->count;
     }
 
+    table_entry* entry = &table->entries[slot];
     entry->key = key;
     entry->val = val;
+    write_barrier(table->owner, OBJECT_VALUE(key));
+    write_barrier(table->owner, val);
     return is_new_key;
 }
 
@@ -103,14 +260,26 @@ bool hash_table_delete(hash_table* table, object_string* key) {
         return false;
     }
 
-    table_entry* entry = find_entry(table->entries, table->capacity, key);
-    if (entry->key == NULL) {
+    int slot = find_slot(table, key);
+    if (slot < 0) {
         return false;
     }
 
-    // Place a tombstone
-    entry->key = NULL;
-    entry->val = BOOL_VALUE(true);
+    table->entries[slot].key = NULL;
+    table->entries[slot].val = NULL_VALUE;
+
+    // If the group still has an empty slot, every lookup passing through it stops here anyway, so
+    // the slot can go straight back to empty instead of becoming a tombstone.
+    // Tombstones are only cleared out by inserts: deletes also run from inside a collection, which
+    // must not move entries around under hash_table_remove_white().
+    const uint8_t* group = &table->control[slot & ~(HASH_TABLE_GROUP_WIDTH - 1)];
+    if (group_match(group, CONTROL_EMPTY) != 0) {
+        table->control[slot] = CONTROL_EMPTY;
+    } else {
+        table->control[slot] = CONTROL_DELETED;
+        ++table->tombstones;
+    }
+    --table->count;
     return true;
 }
 
@@ -128,18 +297,95 @@ object_string* table_find_string(hash_table* table, const char* chars, int lengt
         return NULL;
     }
 
-    uint32_t index = hash % table->capacity;
-    while (true) {
-        table_entry* entry = &table->entries[index];
-        if (entry->key == NULL) {
-            if (IS_NULL(entry->val)) {
-                return NULL;
+    uint8_t tag = HASH_TAG(hash);
+
+    FOR_EACH_PROBE_GROUP(table->capacity, hash, group) {
+        const uint8_t* control = &table->control[group * HASH_TABLE_GROUP_WIDTH];
+
+        for (uint32_t matches = group_match(control, tag); matches != 0; matches &= matches - 1) {
+            object_string* key =
+                table->entries[group * HASH_TABLE_GROUP_WIDTH + lowest_bit(matches)].key;
+            if (key->hash == hash && key->length == length &&
+                memcmp(key->chars, chars, length) == 0) {
+                return key;
+            }
+        }
+
+        if (group_match(control, CONTROL_EMPTY) != 0) {
+            return NULL;
+        }
+    }
+}
+
+void hash_table_mark(hash_table* table) {
+    for (int i = 0; i < table->capacity; ++i) {
+        table_entry* entry = &table->entries[i];
+        mark_object((object*)entry->key);
+        mark_value(entry->val);
+    }
+}
+
+static bool is_unreached(object* obj) {
+#ifdef CLOX_GC_GENERATIONAL
+    // A minor collection never marks the old generation, so old keys are live by definition.
+    if (vm.gc_minor && obj->is_old) {
+        return false;
+    }
+#endif
+    return !obj->is_marked;
+}
+
+// Drops every entry whose key was not reached by the mark phase.  Used on the intern table, which
+// holds its strings weakly.
+void hash_table_remove_white(hash_table* table) {
+    for (int i = 0; i < table->capacity; ++i) {
+        table_entry* entry = &table->entries[i];
+        if (entry->key != NULL && is_unreached(&entry->key->obj)) {
+            hash_table_delete(table, entry->key);
+        }
+    }
+}
+
+void hash_table_probe_stats(hash_table* table, hash_table_stats* stats) {
+    memset(stats, 0, sizeof(hash_table_stats));
+    stats->capacity = table->capacity;
+    stats->count = table->count;
+    stats->tombstones = table->tombstones;
+
+    long total = 0;
+    for (int i = 0; i < table->capacity; ++i) {
+        object_string* key = table->entries[i].key;
+        if (key == NULL) {
+            continue;
+        }
+
+        int probe = 1;
+        FOR_EACH_PROBE_GROUP(table->capacity, key->hash, group) {
+            if ((int)group == i / HASH_TABLE_GROUP_WIDTH) {
+                break;
             }
-        } else if (entry->key->length == length && entry->key->hash == hash &&
-                   memcmp(entry->key->chars, chars, length) == 0) {
-            return entry->key;
+            ++probe;
         }
 
-        index = (index + 1) % table->capacity;
+        total += probe;
+        if (probe > stats->max_probe) {
+            stats->max_probe = probe;
+        }
+        ++stats->probe_lengths[probe < HASH_TABLE_PROBE_BUCKETS ? probe - 1
+                                                                : HASH_TABLE_PROBE_BUCKETS - 1];
+    }
+
+    stats->mean_probe = table->count > 0 ? (double)total / table->count : 0.0;
+}
+
+void hash_table_print_stats(const char* name, hash_table* table) {
+    hash_table_stats stats;
+    hash_table_probe_stats(table, &stats);
+
+    printf("%s: %d/%d slots, %d tombstones, probe groups mean %.2f max %d [", name, stats.count,
+           stats.capacity, stats.tombstones, stats.mean_probe, stats.max_probe);
+    for (int i = 0; i < HASH_TABLE_PROBE_BUCKETS; ++i) {
+        printf(i == 0 ? "%d" : " %d", stats.probe_lengths[i]);
     }
+    printf("]\n");
 }
@@ -1,6 +1,5 @@
 #ifndef JUMI_CLOX_HASH_TABLE_H
 #define JUMI_CLOX_HASH_TABLE_H
-#include "clox_object.h"
 #include "clox_value.h"
 #include "common.h"
 #include "memory.h"
@@ -12,12 +11,41 @@ typedef struct {
     clox_value val;
 } table_entry;
 
+// Open addressing in the style of SwissTable.  Alongside the entries there is one control byte
+// per slot holding either EMPTY, DELETED, or the low 7 bits of the key's hash, and probing
+// compares a whole group of HASH_TABLE_GROUP_WIDTH control bytes at once before touching any
+// entry.  The capacity is always zero or a power of two that is at least one group wide.
+#define HASH_TABLE_GROUP_WIDTH 16
+
+// Tombstones are cleaned out in place once they take up this share of the slots.
+#ifndef CLOX_TABLE_TOMBSTONE_PERCENT
+#define CLOX_TABLE_TOMBSTONE_PERCENT 25
+#endif
+
+#define HASH_TABLE_PROBE_BUCKETS 8
+
 typedef struct {
     int count;
+    int tombstones;
     int capacity;
     table_entry* entries;
+    uint8_t* control;
+    // The heap object this table belongs to, if any, so stores into it can run the GC write
+    // barrier.  Tables hanging off the VM itself are roots and leave this NULL.
+    object* owner;
 } hash_table;
 
+// How many groups a lookup of each live key has to probe, gathered by hash_table_probe_stats().
+typedef struct {
+    int capacity;
+    int count;
+    int tombstones;
+    int max_probe;
+    double mean_probe;
+    // Index i counts keys found in group i + 1 of their probe sequence, the last bucket is open.
+    int probe_lengths[HASH_TABLE_PROBE_BUCKETS];
+} hash_table_stats;
+
 void init_hash_table(hash_table* table);
 void free_hash_table(hash_table* table);
 bool hash_table_get(hash_table* table, object_string* key, clox_value* val);
@@ -25,5 +53,9 @@ bool hash_table_set(hash_table* table, object_string* key, clox_value val);
 bool hash_table_delete(hash_table* table, object_string* key);
 void hash_table_add_all(hash_table* from, hash_table* to);
 object_string* table_find_string(hash_table* table, const char* chars, int length, uint32_t hash);
+void hash_table_mark(hash_table* table);
+void hash_table_remove_white(hash_table* table);
+void hash_table_probe_stats(hash_table* table, hash_table_stats* stats);
+void hash_table_print_stats(const char* name, hash_table* table);
 
 #endif
@@ -259,6 +259,10 @@ token lexer_scan_token(void) {
             return make_token(TOKEN_LEFT_BRACE);
         case '}':
             return make_token(TOKEN_RIGHT_BRACE);
+        case '[':
+            return make_token(TOKEN_LEFT_BRACKET);
+        case ']':
+            return make_token(TOKEN_RIGHT_BRACKET);
         case ';':
             return make_token(TOKEN_SEMICOLON);
         case ':':
@@ -300,6 +304,10 @@ const char* token_type_tostr(token_type type) {
             return "TOKEN_LEFT_BRACE";
         case TOKEN_RIGHT_BRACE:
             return "TOKEN_RIGHT_BRACE";
+        case TOKEN_LEFT_BRACKET:
+            return "TOKEN_LEFT_BRACKET";
+        case TOKEN_RIGHT_BRACKET:
+            return "TOKEN_RIGHT_BRACKET";
         case TOKEN_CASE:
             return "TOKEN_CASE";
         case TOKEN_COLON:
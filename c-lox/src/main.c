@@ -1,4 +1,5 @@
 #include "editline/readline.h"
+#include "compiler.h"
 #include "virtual_machine.h"
 #include <stdio.h>
 #include <stdlib.h>
@@ -73,12 +74,19 @@ static void run_file(const char* path) {
 int main(int argc, const char* argv[]) {
     init_virtual_machine();
 
-    if (argc == 1) {
+    // '-O' runs the peephole optimizer over every compiled chunk.
+    int arg = 1;
+    if (arg < argc && strcmp(argv[arg], "-O") == 0) {
+        set_compiler_optimization(true);
+        ++arg;
+    }
+
+    if (arg == argc) {
         run_repl();
-    } else if (argc == 2) {
-        run_file(argv[1]);
+    } else if (arg + 1 == argc) {
+        run_file(argv[arg]);
     } else {
-        fprintf(stderr, "Usage: clox [path]\n");
+        fprintf(stderr, "Usage: clox [-O] [path]\n");
     }
 
     return 0;
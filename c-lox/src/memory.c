@@ -1,7 +1,17 @@
 #include "memory.h"
 #include "clox_object.h"
+#include "compiler.h"
+#include "pool_allocator.h"
 #include "virtual_machine.h"
+#include <stdio.h>
 #include <stdlib.h>
+#include <time.h>
+
+#define GC_HEAP_GROW_FACTOR 2
+
+#ifdef CLOX_GC_GENERATIONAL
+static void collect_incremental(void);
+#endif
 
 // oldSize           newSize                  Operation
 // 0                 Non‑zero                 Allocate new block.
@@ -9,6 +19,32 @@
 // Non‑zero          Smaller than oldSize     Shrink existing allocation.
 // Non‑zero          Larger than oldSize      Grow existing allocation.
 void* reallocate(void* pointer, size_t old_size, size_t new_size) {
+    vm.bytes_allocated += new_size - old_size;
+
+    // Only growing the heap can push us over the threshold.
+    if (new_size > old_size) {
+#ifdef CLOX_GC_GENERATIONAL
+        vm.bytes_since_minor += new_size - old_size;
+#ifdef DEBUG_STRESS_GC
+        collect_incremental();
+#else
+        if (vm.bytes_since_minor > (size_t)CLOX_GC_NURSERY_KB * 1024) {
+            collect_incremental();
+        }
+#endif
+#else
+#ifdef DEBUG_STRESS_GC
+        collect_garbage();
+#endif
+        if (vm.bytes_allocated > vm.next_gc) {
+            collect_garbage();
+        }
+#endif
+    }
+
+#ifdef CLOX_POOL_ALLOCATOR
+    return pool_reallocate(pointer, old_size, new_size);
+#else
     if (new_size == 0) {
         free(pointer);
         return NULL;
@@ -19,31 +55,547 @@ void* reallocate(void* pointer, size_t old_size, size_t new_size) {
         exit(EXIT_FAILURE);
     }
     return result;
+#endif
+}
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+static void record_pause(uint64_t start_ns) {
+    uint64_t pause = now_ns() - start_ns;
+    uint64_t micros = pause / 1000;
+
+    int bucket = 0;
+    while (bucket < GC_PAUSE_BUCKETS - 1 && micros >= ((uint64_t)1 << bucket)) {
+        ++bucket;
+    }
+
+    ++vm.gc.pause_buckets[bucket];
+    ++vm.gc.pause_count;
+    vm.gc.total_pause_ns += pause;
+    if (pause > vm.gc.max_pause_ns) {
+        vm.gc.max_pause_ns = pause;
+    }
+}
+
+void print_gc_stats(void) {
+    printf("gc pauses: %llu (minor %llu, major %llu), max %lluus, total %lluus\n",
+           (unsigned long long)vm.gc.pause_count, (unsigned long long)vm.gc.minor_count,
+           (unsigned long long)vm.gc.major_count,
+           (unsigned long long)(vm.gc.max_pause_ns / 1000),
+           (unsigned long long)(vm.gc.total_pause_ns / 1000));
+
+    for (int i = 0; i < GC_PAUSE_BUCKETS; ++i) {
+        if (vm.gc.pause_buckets[i] == 0) {
+            continue;
+        }
+
+        if (i == GC_PAUSE_BUCKETS - 1) {
+            printf("  >= %8lluus: %llu\n", (unsigned long long)1 << (i - 1),
+                   (unsigned long long)vm.gc.pause_buckets[i]);
+        } else {
+            printf("  <  %8lluus: %llu\n", (unsigned long long)1 << i,
+                   (unsigned long long)vm.gc.pause_buckets[i]);
+        }
+    }
+}
+
+static void push_gray(object* obj) {
+    // The gray stack is allocated with the system allocator so that growing it can't recursively
+    // start another collection.
+    if (vm.gray_count >= vm.gray_capacity) {
+        vm.gray_capacity = GROW_CAPACITY(vm.gray_capacity);
+        vm.gray_stack = (object**)realloc(vm.gray_stack, sizeof(object*) * vm.gray_capacity);
+        if (vm.gray_stack == NULL) {
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    vm.gray_stack[vm.gray_count++] = obj;
+}
+
+void mark_object(object* obj) {
+    if (obj == NULL || obj->is_marked) {
+        return;
+    }
+
+#ifdef CLOX_GC_GENERATIONAL
+    // A minor collection only traces the nursery and treats the old generation as live.  A major
+    // cycle only traces the old generation: it always starts and finishes right after a minor
+    // collection has emptied the nursery, and anything allocated in between is promoted gray.
+    if (obj->is_old == vm.gc_minor) {
+        return;
+    }
+#endif
+
+#ifdef DEBUG_LOG_GC
+    printf("%p mark ", (void*)obj);
+    print_value(OBJECT_VALUE(obj));
+    printf("\n");
+#endif
+
+    obj->is_marked = true;
+    push_gray(obj);
+}
+
+void mark_value(clox_value val) {
+    if (IS_OBJECT(val)) {
+        mark_object(AS_OBJECT(val));
+    }
+}
+
+static void mark_array(value_array* array) {
+    for (int i = 0; i < array->count; ++i) {
+        mark_value(array->values[i]);
+    }
+}
+
+static void blacken_object(object* obj) {
+#ifdef DEBUG_LOG_GC
+    printf("%p blacken ", (void*)obj);
+    print_value(OBJECT_VALUE(obj));
+    printf("\n");
+#endif
+
+    switch (obj->type) {
+        case OBJECT_BOUND_METHOD: {
+            object_bound_method* bound = (object_bound_method*)obj;
+            mark_value(bound->receiver);
+            mark_value(bound->method);
+        } break;
+        case OBJECT_CLASS: {
+            object_class* klass = (object_class*)obj;
+            mark_object((object*)klass->name);
+            hash_table_mark(&klass->methods);
+        } break;
+        case OBJECT_CLOSURE: {
+            object_closure* closure = (object_closure*)obj;
+            mark_object((object*)closure->function);
+            for (int i = 0; i < closure->upvalue_count; ++i) {
+                mark_object((object*)closure->upvalues[i]);
+            }
+        } break;
+        case OBJECT_FUNCTION: {
+            object_function* function = (object_function*)obj;
+            mark_object((object*)function->name);
+            mark_array(&function->chunk.constants);
+            // The class keeps the cached method alive too, and shapes are never collected.
+            for (int i = 0; i < function->chunk.mc_count; ++i) {
+                mark_object((object*)function->chunk.method_caches[i].klass);
+            }
+        } break;
+        case OBJECT_INSTANCE: {
+            object_instance* instance = (object_instance*)obj;
+            mark_object((object*)instance->klass);
+            mark_object((object*)instance->shape);
+            for (int i = 0; i < instance->shape->field_count; ++i) {
+                mark_value(instance->fields[i]);
+            }
+        } break;
+        case OBJECT_LIST: {
+            object_list* list = (object_list*)obj;
+            if (list->base != NULL) {
+                mark_object((object*)list->base);
+            } else {
+                mark_array(&list->items);
+            }
+        } break;
+        case OBJECT_SHAPE: {
+            object_shape* shape = (object_shape*)obj;
+            hash_table_mark(&shape->slots);
+            hash_table_mark(&shape->transitions);
+        } break;
+        case OBJECT_UPVALUE: {
+            mark_value(((object_upvalue*)obj)->closed);
+        } break;
+        case OBJECT_NATIVE:
+        case OBJECT_STRING:
+            break;
+    }
 }
 
 static void free_object(object* obj) {
+#ifdef DEBUG_LOG_GC
+    printf("%p free type %d\n", (void*)obj, obj->type);
+#endif
+
     switch (obj->type) {
+        case OBJECT_BOUND_METHOD: {
+            FREE(object_bound_method, obj);
+        } break;
+        case OBJECT_CLASS: {
+            free_hash_table(&((object_class*)obj)->methods);
+            FREE(object_class, obj);
+        } break;
+        case OBJECT_CLOSURE: {
+            object_closure* closure = (object_closure*)obj;
+            FREE_ARRAY(object_upvalue*, closure->upvalues, closure->upvalue_count);
+            FREE(object_closure, obj);
+        } break;
         case OBJECT_FUNCTION: {
             object_function* func = (object_function*)obj;
             free_bytecode_chunk(&func->chunk);
+            FREE_ARRAY(upvalue_capture, func->captures, func->upvalue_count);
             FREE(object_function, obj);
         } break;
+        case OBJECT_INSTANCE: {
+            object_instance* instance = (object_instance*)obj;
+            FREE_ARRAY(clox_value, instance->fields, instance->field_capacity);
+            FREE(object_instance, obj);
+        } break;
+        case OBJECT_LIST: {
+            free_value_array(&((object_list*)obj)->items);
+            FREE(object_list, obj);
+        } break;
+        case OBJECT_SHAPE: {
+            object_shape* shape = (object_shape*)obj;
+            free_hash_table(&shape->slots);
+            free_hash_table(&shape->transitions);
+            FREE(object_shape, obj);
+        } break;
+        case OBJECT_UPVALUE: {
+            FREE(object_upvalue, obj);
+        } break;
         case OBJECT_NATIVE: {
             FREE(object_native, obj);
         } break;
         case OBJECT_STRING: {
             object_string* string = (object_string*)obj;
-            FREE_ARRAY(char, string->chars, string->length);
-            FREE(object_string, obj);
+            reallocate(obj, STRING_SIZE(string->length), 0);
         } break;
     }
 }
 
-void free_objects(void) {
-    object* obj = vm.objects;
+static void free_object_list(object* obj) {
     while (obj != NULL) {
         object* next = obj->next;
         free_object(obj);
         obj = next;
     }
 }
+
+static void mark_roots(void) {
+    for (clox_value* slot = vm.stack; slot < vm.stack_top; ++slot) {
+        mark_value(*slot);
+    }
+
+    for (int i = 0; i < vm.frame_count; ++i) {
+        mark_object((object*)vm.frames[i].function);
+        mark_object((object*)vm.frames[i].closure);
+    }
+
+    for (object_upvalue* upvalue = vm.open_upvalues; upvalue != NULL; upvalue = upvalue->next) {
+        mark_object((object*)upvalue);
+    }
+
+    for (int i = 0; i < vm.global_count; ++i) {
+        mark_object((object*)vm.globals[i].name);
+        mark_value(vm.globals[i].val);
+    }
+    hash_table_mark(&vm.global_names);
+    mark_object((object*)vm.init_string);
+    mark_object((object*)vm.empty_shape);
+
+    mark_compiler_roots();
+}
+
+// Blackens gray objects until only 'floor' remain on the gray stack.
+static void trace_references(int floor) {
+    while (vm.gray_count > floor) {
+        object* obj = vm.gray_stack[--vm.gray_count];
+        blacken_object(obj);
+    }
+}
+
+#ifndef CLOX_GC_GENERATIONAL
+
+static void sweep(void) {
+    object* previous = NULL;
+    object* obj = vm.objects;
+
+    while (obj != NULL) {
+        if (obj->is_marked) {
+            obj->is_marked = false;
+            previous = obj;
+            obj = obj->next;
+            continue;
+        }
+
+        object* unreached = obj;
+        obj = obj->next;
+        if (previous != NULL) {
+            previous->next = obj;
+        } else {
+            vm.objects = obj;
+        }
+
+        free_object(unreached);
+    }
+}
+
+void collect_garbage(void) {
+#ifdef DEBUG_LOG_GC
+    printf("-- gc begin\n");
+    size_t before = vm.bytes_allocated;
+#endif
+    uint64_t start = now_ns();
+
+    mark_roots();
+    trace_references(0);
+    // Interned strings are weak references: drop the ones nothing else reached before sweeping
+    // frees them, otherwise the table would be left with dangling keys.
+    hash_table_remove_white(&vm.interned_strings);
+    sweep();
+
+    vm.next_gc = vm.bytes_allocated * GC_HEAP_GROW_FACTOR;
+
+    ++vm.gc.major_count;
+    record_pause(start);
+
+#ifdef DEBUG_LOG_GC
+    printf("-- gc end\n");
+    printf("   collected %zu bytes (from %zu to %zu) next at %zu\n", before - vm.bytes_allocated,
+           before, vm.bytes_allocated, vm.next_gc);
+#endif
+}
+
+#else
+
+// Generational mode.  Pauses come in two kinds, both bounded:
+//
+// - Minor collections trace only the nursery, starting from the roots and the remembered set (old
+//   objects that were handed a nursery reference).  Every survivor is promoted, so a minor pause is
+//   proportional to the roots plus the nursery size.
+//
+// - The old generation is collected by an incremental major cycle.  Marking and sweeping are each
+//   split into steps that piggyback on minor collections and stop once the pause budget is spent.
+//   A Dijkstra style insertion barrier keeps the marking sound while the program keeps running.
+//
+// VM stack slots and globals are roots, and every pause rescans them, so stores into them need no
+// barrier.  Only stores into heap objects go through write_barrier().
+
+#ifdef DEBUG_STRESS_GC
+// Take the smallest possible steps so that every interleaving of mutator and collector gets hit.
+#define GC_STEP_WORK 1
+#else
+#define GC_STEP_WORK 64
+#endif
+
+static void remember_object(object* obj) {
+    obj->is_remembered = true;
+
+    if (vm.remembered_count >= vm.remembered_capacity) {
+        vm.remembered_capacity = GROW_CAPACITY(vm.remembered_capacity);
+        vm.remembered =
+            (object**)realloc(vm.remembered, sizeof(object*) * vm.remembered_capacity);
+        if (vm.remembered == NULL) {
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    vm.remembered[vm.remembered_count++] = obj;
+}
+
+void write_barrier(object* owner, clox_value val) {
+    if (owner == NULL || !IS_OBJECT(val)) {
+        return;
+    }
+
+    object* target = AS_OBJECT(val);
+
+    // Generational invariant: the next minor collection must see this old -> young edge.
+    if (owner->is_old && !target->is_old && !owner->is_remembered) {
+        remember_object(owner);
+    }
+
+    // Incremental invariant: a black object must never point at a white one.
+    if (vm.gc_phase == GC_MARKING && owner->is_marked && target->is_old) {
+        mark_object(target);
+    }
+}
+
+static void promote_survivors(void) {
+    object* obj = vm.objects;
+    while (obj != NULL) {
+        object* next = obj->next;
+
+        if (obj->is_marked) {
+            obj->is_old = true;
+            obj->next = vm.old_objects;
+            vm.old_objects = obj;
+
+            // Promoting into a cycle that is still marking: treat the object as reachable and
+            // let the major cycle trace it, the mutator may have moved old references into it.
+            if (vm.gc_phase == GC_MARKING) {
+                push_gray(obj);
+            } else {
+                obj->is_marked = false;
+            }
+        } else {
+            free_object(obj);
+        }
+
+        obj = next;
+    }
+
+    vm.objects = NULL;
+}
+
+static void minor_collection(void) {
+    vm.gc_minor = true;
+    int floor = vm.gray_count;
+
+    mark_roots();
+    for (int i = 0; i < vm.remembered_count; ++i) {
+        vm.remembered[i]->is_remembered = false;
+        blacken_object(vm.remembered[i]);
+    }
+    vm.remembered_count = 0;
+
+    // The major cycle may have gray objects of its own parked below 'floor'.
+    trace_references(floor);
+    hash_table_remove_white(&vm.interned_strings);
+
+    vm.gc_minor = false;
+    promote_survivors();
+    vm.bytes_since_minor = 0;
+    ++vm.gc.minor_count;
+}
+
+static bool budget_spent(uint64_t start, int work) {
+#ifdef DEBUG_STRESS_GC
+    (void)start;
+    return work >= GC_STEP_WORK;
+#else
+    return work % GC_STEP_WORK == 0 && now_ns() - start >= (uint64_t)CLOX_GC_PAUSE_BUDGET_US * 1000;
+#endif
+}
+
+static void start_major_cycle(void) {
+    vm.gc_phase = GC_MARKING;
+    mark_roots();
+}
+
+static void finish_marking(void) {
+    // Atomic remark: roots may have changed since they were first scanned.
+    mark_roots();
+    trace_references(0);
+    hash_table_remove_white(&vm.interned_strings);
+
+    // Everything promoted from now on is allocated after the mark, so it starts a fresh list
+    // instead of joining the one being swept.
+    vm.sweep_objects = vm.old_objects;
+    vm.old_objects = NULL;
+    vm.gc_phase = GC_SWEEPING;
+}
+
+static void mark_step(uint64_t start, bool unbounded) {
+    int work = 0;
+    while (vm.gray_count > 0) {
+        if (!unbounded && budget_spent(start, work)) {
+            return;
+        }
+        blacken_object(vm.gray_stack[--vm.gray_count]);
+        ++work;
+    }
+
+    finish_marking();
+}
+
+static void sweep_step(uint64_t start, bool unbounded) {
+    int work = 0;
+    while (vm.sweep_objects != NULL) {
+        if (!unbounded && budget_spent(start, work)) {
+            return;
+        }
+
+        object* obj = vm.sweep_objects;
+        vm.sweep_objects = obj->next;
+
+        if (obj->is_marked) {
+            obj->is_marked = false;
+            obj->next = vm.old_objects;
+            vm.old_objects = obj;
+        } else {
+            free_object(obj);
+        }
+        ++work;
+    }
+
+    vm.gc_phase = GC_IDLE;
+    vm.next_gc = vm.bytes_allocated * GC_HEAP_GROW_FACTOR;
+    ++vm.gc.major_count;
+}
+
+// One pause: a minor collection followed by at most one budgeted slice of major work.
+static void collect_incremental(void) {
+#ifdef DEBUG_LOG_GC
+    printf("-- gc step begin (phase %d)\n", vm.gc_phase);
+#endif
+    uint64_t start = now_ns();
+
+    minor_collection();
+
+    // If allocation outruns the marker, give up on incrementality rather than on memory.
+    bool unbounded = vm.bytes_allocated > vm.next_gc * GC_HEAP_GROW_FACTOR;
+
+    switch (vm.gc_phase) {
+        case GC_IDLE: {
+#ifdef DEBUG_STRESS_GC
+            start_major_cycle();
+#else
+            if (vm.bytes_allocated > vm.next_gc) {
+                start_major_cycle();
+            }
+#endif
+        } break;
+        case GC_MARKING: {
+            mark_step(start, unbounded);
+        } break;
+        case GC_SWEEPING: {
+            sweep_step(start, unbounded);
+        } break;
+    }
+
+    record_pause(start);
+
+#ifdef DEBUG_LOG_GC
+    printf("-- gc step end (phase %d) %zu bytes allocated\n", vm.gc_phase, vm.bytes_allocated);
+#endif
+}
+
+void collect_garbage(void) {
+    uint64_t start = now_ns();
+
+    minor_collection();
+    if (vm.gc_phase == GC_IDLE) {
+        start_major_cycle();
+    }
+    if (vm.gc_phase == GC_MARKING) {
+        mark_step(start, true);
+    }
+    sweep_step(start, true);
+
+    record_pause(start);
+}
+
+#endif
+
+void free_objects(void) {
+    free_object_list(vm.objects);
+#ifdef CLOX_GC_GENERATIONAL
+    free_object_list(vm.old_objects);
+    free_object_list(vm.sweep_objects);
+    free(vm.remembered);
+#endif
+
+    free(vm.gray_stack);
+#ifdef CLOX_POOL_ALLOCATOR
+    // The globals array and the tables have already been freed by now, so every pooled block is
+    // dead and the slabs can go back to the system in one pass.
+    pool_release_all();
+#endif
+}
@@ -1,5 +1,6 @@
 #ifndef JUMI_CLOX_MEMORY_H
 #define JUMI_CLOX_MEMORY_H
+#include "clox_value.h"
 #include "common.h"
 
 #define ALLOCATE(type, count) (type*)reallocate(NULL, 0, sizeof(type) * (count));
@@ -13,7 +14,44 @@
 
 #define FREE_ARRAY(type, pointer, old_count) reallocate(pointer, sizeof(type) * (old_count), 0)
 
+#ifndef CLOX_GC_NURSERY_KB
+#define CLOX_GC_NURSERY_KB 256
+#endif
+
+#ifndef CLOX_GC_PAUSE_BUDGET_US
+#define CLOX_GC_PAUSE_BUDGET_US 500
+#endif
+
+// Pause i lands in bucket i when it took less than 2^i microseconds; the last bucket takes the
+// rest.
+#define GC_PAUSE_BUCKETS 24
+
+typedef struct {
+    uint64_t pause_buckets[GC_PAUSE_BUCKETS];
+    uint64_t pause_count;
+    uint64_t total_pause_ns;
+    uint64_t max_pause_ns;
+    uint64_t minor_count;
+    uint64_t major_count;
+} gc_stats;
+
+#ifdef CLOX_GC_GENERATIONAL
+typedef enum {
+    GC_IDLE,
+    GC_MARKING,
+    GC_SWEEPING,
+} gc_phase;
+
+void write_barrier(object* owner, clox_value val);
+#else
+#define write_barrier(owner, val) ((void)0)
+#endif
+
 void* reallocate(void* pointer, size_t old_size, size_t new_size);
+void mark_object(object* obj);
+void mark_value(clox_value val);
+void collect_garbage(void);
 void free_objects(void);
+void print_gc_stats(void);
 
 #endif
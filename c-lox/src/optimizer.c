@@ -0,0 +1,525 @@
+#include "optimizer.h"
+#include "memory.h"
+
+// A peephole pass over a finished chunk.  The chunk is decoded into a list of instructions whose
+// jumps point at other instructions rather than byte offsets, the rewrites below run until none of
+// them finds anything left to do, and the surviving instructions are encoded back with every jump
+// offset and line run recomputed.
+//
+// The compiler also runs the chunk through here without any rewrites when a forward jump
+// overflowed its operand, as re-encoding is what picks wide jumps wherever they're needed.
+
+typedef struct {
+    uint8_t op;
+    // Operand bytes of anything but a jump, copied out so that fusing two instructions can
+    // combine theirs.
+    uint8_t operands[3];
+    int line;
+    // Index of the instruction a jump lands on, which may have been removed since, in which case
+    // the jump really lands on the next instruction that wasn't.
+    int target;
+    bool is_target;
+    bool removed;
+    // Set once a jump is known to need a 24 bit operand.
+    bool wide;
+} instruction;
+
+typedef struct {
+    instruction* code;
+    int count;
+    // While the chunk is being rewritten, its switch tables hold instruction indices rather than
+    // offsets.
+    bytecode_chunk* chunk;
+} instruction_list;
+
+static bool is_compare_jump(uint8_t op) {
+    return op == OP_EQUAL_JUMP_IF_FALSE || op == OP_NOT_EQUAL_JUMP_IF_FALSE ||
+           op == OP_GREATER_JUMP_IF_FALSE || op == OP_LESS_JUMP_IF_FALSE;
+}
+
+static bool is_jump(uint8_t op) {
+    return op == OP_JUMP || op == OP_JUMP_IF_FALSE || op == OP_POP_JUMP_IF_FALSE || op == OP_LOOP ||
+           is_compare_jump(op);
+}
+
+static bool is_unconditional(uint8_t op) {
+    return op == OP_JUMP || op == OP_LOOP || op == OP_SWITCH || op == OP_RETURN;
+}
+
+
+static int next_live(instruction_list* list, int index) {
+    while (index < list->count && list->code[index].removed) {
+        ++index;
+    }
+    return index;
+}
+
+static uint8_t op_at(instruction_list* list, int index) {
+    return index < list->count ? list->code[index].op : OP_RETURN;
+}
+
+static switch_table* table_of(instruction_list* list, instruction* instr) {
+    return &list->chunk->switch_tables[(instr->operands[0] << 8) | instr->operands[1]];
+}
+
+static void mark_target(instruction_list* list, int index) {
+    int target = next_live(list, index);
+    if (target < list->count) {
+        list->code[target].is_target = true;
+    }
+}
+static void mark_targets(instruction_list* list) {
+    for (int i = 0; i < list->count; ++i) {
+        list->code[i].is_target = false;
+    }
+
+    for (int i = 0; i < list->count; ++i) {
+        instruction* instr = &list->code[i];
+        if (instr->removed) {
+            continue;
+        }
+
+        if (is_jump(instr->op)) {
+            mark_target(list, instr->target);
+        } else if (instr->op == OP_SWITCH) {
+            switch_table* table = table_of(list, instr);
+            mark_target(list, table->miss);
+            for (int t = 0; t < table->capacity; ++t) {
+                if (table->targets[t] >= 0) {
+                    mark_target(list, table->targets[t]);
+                }
+            }
+        }
+    }
+}
+
+// OP_EQUAL, OP_LESS and OP_GREATER followed by OP_NOT become a single fused comparison.
+static bool fuse_comparisons(instruction_list* list) {
+    bool changed = false;
+
+    for (int i = 0; i < list->count; ++i) {
+        instruction* instr = &list->code[i];
+        if (instr->removed) {
+            continue;
+        }
+
+        int next = next_live(list, i + 1);
+        if (op_at(list, next) != OP_NOT || list->code[next].is_target) {
+            continue;
+        }
+
+        switch (instr->op) {
+            case OP_EQUAL:
+                instr->op = OP_NOT_EQUAL;
+                break;
+            case OP_LESS:
+                instr->op = OP_GREATER_EQUAL;
+                break;
+            case OP_GREATER:
+                instr->op = OP_LESS_EQUAL;
+                break;
+            default:
+                continue;
+        }
+
+        list->code[next].removed = true;
+        changed = true;
+    }
+
+    return changed;
+}
+
+// Every 'if', 'while', 'for' and 'case' compiles to OP_JUMP_IF_FALSE followed by an OP_POP on the
+// fallthrough path and another OP_POP where the jump lands.  When both are there the jump can pop
+// the condition itself and land just past the second OP_POP.
+static bool fuse_pop_jumps(instruction_list* list) {
+    bool changed = false;
+
+    for (int i = 0; i < list->count; ++i) {
+        instruction* instr = &list->code[i];
+        if (instr->removed || instr->op != OP_JUMP_IF_FALSE) {
+            continue;
+        }
+
+        int next = next_live(list, i + 1);
+        int target = next_live(list, instr->target);
+        if (op_at(list, next) != OP_POP || list->code[next].is_target ||
+            op_at(list, target) != OP_POP) {
+            continue;
+        }
+
+        instr->op = OP_POP_JUMP_IF_FALSE;
+        instr->target = target + 1;
+        list->code[next].removed = true;
+        changed = true;
+    }
+
+    return changed;
+}
+
+// A jump that lands on an unconditional jump can go straight to where that one goes.  The same
+// holds for an OP_JUMP_IF_FALSE landing on another one, as happens in chains of 'and', since the
+// value it tests is still on the stack and still false.
+static bool thread_jumps(instruction_list* list) {
+    bool changed = false;
+
+    for (int i = 0; i < list->count; ++i) {
+        instruction* instr = &list->code[i];
+        if (instr->removed || !is_jump(instr->op) || instr->op == OP_LOOP) {
+            continue;
+        }
+
+        // Bounded so that a cycle of jumps can't hang the compiler.
+        for (int hops = 0; hops < list->count; ++hops) {
+            int target = next_live(list, instr->target);
+            uint8_t target_op = op_at(list, target);
+
+            if (target < list->count && target != i &&
+                (target_op == OP_JUMP ||
+                 (instr->op == OP_JUMP_IF_FALSE && target_op == OP_JUMP_IF_FALSE))) {
+                instr->target = list->code[target].target;
+                changed = true;
+            } else {
+                break;
+            }
+        }
+    }
+
+    return changed;
+}
+
+// Jumps to the very next instruction do nothing, apart from the pop of OP_POP_JUMP_IF_FALSE.
+static bool remove_empty_jumps(instruction_list* list) {
+    bool changed = false;
+
+    for (int i = 0; i < list->count; ++i) {
+        instruction* instr = &list->code[i];
+        if (instr->removed || !is_jump(instr->op) || instr->op == OP_LOOP ||
+            is_compare_jump(instr->op) || next_live(list, instr->target) != next_live(list, i + 1)) {
+            continue;
+        }
+
+        if (instr->op == OP_POP_JUMP_IF_FALSE) {
+            instr->op = OP_POP;
+        } else {
+            instr->removed = true;
+        }
+        changed = true;
+    }
+
+    return changed;
+}
+
+// Nothing after an unconditional jump or a return runs until the next jump target, which is where
+// the implicit 'return null' after an explicit return ends up.
+static bool remove_dead_code(instruction_list* list) {
+    bool changed = false;
+
+    for (int i = 0; i < list->count; ++i) {
+        if (list->code[i].removed || !is_unconditional(list->code[i].op)) {
+            continue;
+        }
+
+        int next = next_live(list, i + 1);
+        while (next < list->count && !list->code[next].is_target) {
+            list->code[next].removed = true;
+            changed = true;
+            next = next_live(list, next + 1);
+        }
+    }
+
+    return changed;
+}
+
+// Pairs that showed up most often in an opcode pair profile of the benchmarks are merged into one
+// superinstruction, saving a dispatch each.  This runs once the other rewrites are done with, since
+// none of them know about the fused opcodes, and the second instruction of a pair can't be a jump
+// target or the jump would land in the middle of it.
+static void form_superinstructions(instruction_list* list) {
+    for (int i = 0; i < list->count; ++i) {
+        instruction* instr = &list->code[i];
+        if (instr->removed) {
+            continue;
+        }
+
+        int next = next_live(list, i + 1);
+        if (next >= list->count || list->code[next].is_target) {
+            continue;
+        }
+
+        instruction* second = &list->code[next];
+        switch (instr->op) {
+            case OP_GET_LOCAL:
+                if (second->op != OP_CONSTANT) {
+                    continue;
+                }
+                instr->op = OP_GET_LOCAL_CONSTANT;
+                instr->operands[1] = second->operands[0];
+                break;
+            case OP_SET_LOCAL:
+                if (second->op != OP_POP) {
+                    continue;
+                }
+                instr->op = OP_SET_LOCAL_POP;
+                break;
+            case OP_SET_GLOBAL:
+                if (second->op != OP_POP) {
+                    continue;
+                }
+                instr->op = OP_SET_GLOBAL_POP;
+                break;
+            case OP_EQUAL:
+            case OP_NOT_EQUAL:
+            case OP_GREATER:
+            case OP_LESS:
+                if (second->op != OP_POP_JUMP_IF_FALSE) {
+                    continue;
+                }
+                instr->op = instr->op == OP_EQUAL       ? OP_EQUAL_JUMP_IF_FALSE
+                            : instr->op == OP_NOT_EQUAL ? OP_NOT_EQUAL_JUMP_IF_FALSE
+                            : instr->op == OP_GREATER   ? OP_GREATER_JUMP_IF_FALSE
+                                                        : OP_LESS_JUMP_IF_FALSE;
+                instr->target = second->target;
+                break;
+            default:
+                continue;
+        }
+
+        second->removed = true;
+    }
+}
+
+// Instructions are decoded in a canonical form, with long jumps and the operand-free local opcodes
+// turned back into their plain versions, so the rewrites above only have one of each to look for.
+// encode() picks the compact or wide form again.
+static void decode(bytecode_chunk* chunk, instruction_list* list, int* index_of,
+                   const far_jump* far_jumps, int far_jump_count) {
+    int run = 0;
+    int run_end = chunk->lr_count > 0 ? chunk->line_runs[0].count : 0;
+
+    list->count = 0;
+    for (int offset = 0; offset < chunk->count; offset += opcode_length(chunk->code[offset])) {
+        while (offset >= run_end && run + 1 < chunk->lr_count) {
+            run_end += chunk->line_runs[++run].count;
+        }
+
+        index_of[offset] = list->count;
+        instruction* instr = &list->code[list->count++];
+        *instr = (instruction){
+            .op = chunk->code[offset],
+            .line = chunk->line_runs[run].line,
+            .target = -1,
+            .is_target = false,
+            .removed = false,
+            .wide = false,
+        };
+        for (int b = 1; b < opcode_length(instr->op); ++b) {
+            instr->operands[b - 1] = chunk->code[offset + b];
+        }
+
+        if (instr->op >= OP_GET_LOCAL_0 && instr->op <= OP_GET_LOCAL_3) {
+            instr->operands[0] = (uint8_t)(instr->op - OP_GET_LOCAL_0);
+            instr->op = OP_GET_LOCAL;
+        } else if (instr->op >= OP_SET_LOCAL_0 && instr->op <= OP_SET_LOCAL_3) {
+            instr->operands[0] = (uint8_t)(instr->op - OP_SET_LOCAL_0);
+            instr->op = OP_SET_LOCAL;
+        } else if (instr->op == OP_JUMP_LONG) {
+            instr->op = OP_JUMP;
+        } else if (instr->op == OP_JUMP_IF_FALSE_LONG) {
+            instr->op = OP_JUMP_IF_FALSE;
+        } else if (instr->op == OP_LOOP_LONG) {
+            instr->op = OP_LOOP;
+        }
+    }
+    index_of[chunk->count] = list->count;
+
+    for (int offset = 0; offset < chunk->count; offset += opcode_length(chunk->code[offset])) {
+        instruction* instr = &list->code[index_of[offset]];
+        if (!is_jump(instr->op)) {
+            continue;
+        }
+
+        int target = jump_target(chunk, offset);
+        for (int i = 0; i < far_jump_count; ++i) {
+            if (far_jumps[i].offset == offset) {
+                target = far_jumps[i].target;
+            }
+        }
+        instr->target = index_of[target];
+    }
+
+    for (int i = 0; i < chunk->st_count; ++i) {
+        switch_table* table = &chunk->switch_tables[i];
+        table->miss = index_of[table->miss];
+        for (int t = 0; t < table->capacity; ++t) {
+            if (table->targets[t] >= 0) {
+                table->targets[t] = index_of[table->targets[t]];
+            }
+        }
+    }
+}
+
+static uint8_t encoded_op(instruction* instr) {
+    switch (instr->op) {
+        case OP_GET_LOCAL:
+            return instr->operands[0] < 4 ? OP_GET_LOCAL_0 + instr->operands[0] : OP_GET_LOCAL;
+        case OP_SET_LOCAL:
+            return instr->operands[0] < 4 ? OP_SET_LOCAL_0 + instr->operands[0] : OP_SET_LOCAL;
+        case OP_JUMP:
+            return instr->wide ? OP_JUMP_LONG : OP_JUMP;
+        case OP_JUMP_IF_FALSE:
+            return instr->wide ? OP_JUMP_IF_FALSE_LONG : OP_JUMP_IF_FALSE;
+        case OP_LOOP:
+            return instr->wide ? OP_LOOP_LONG : OP_LOOP;
+        default:
+            return instr->op;
+    }
+}
+
+// Lays the surviving instructions out and returns whether any jump turned out too far for a 16 bit
+// operand, in which case it is marked wide and the layout has to be done again.
+static bool layout(instruction_list* list, int* new_offset) {
+    // A removed instruction's offset is that of the next one that survived, which is where any
+    // jump still aimed at it has to land.
+    int offset = 0;
+    for (int i = 0; i < list->count; ++i) {
+        if (!list->code[i].removed) {
+            new_offset[i] = offset;
+            offset += opcode_length(encoded_op(&list->code[i]));
+        }
+    }
+    new_offset[list->count] = offset;
+    for (int i = list->count - 1; i >= 0; --i) {
+        if (list->code[i].removed) {
+            new_offset[i] = new_offset[i + 1];
+        }
+    }
+
+    bool widened = false;
+    for (int i = 0; i < list->count; ++i) {
+        instruction* instr = &list->code[i];
+        if (instr->removed || !is_jump(instr->op) || instr->wide) {
+            continue;
+        }
+
+        int end = new_offset[i] + 3;
+        int destination = new_offset[instr->target];
+        int jump = instr->op == OP_LOOP ? end - destination : destination - end;
+        if (jump > UINT16_MAX) {
+            instr->wide = true;
+            widened = true;
+        }
+    }
+    return widened;
+}
+
+static void encode(bytecode_chunk* chunk, instruction_list* list, int* new_offset) {
+    // Widening a jump only ever pushes code further apart, so this settles.
+    while (layout(list, new_offset)) {
+    }
+
+    for (int i = 0; i < chunk->st_count; ++i) {
+        switch_table* table = &chunk->switch_tables[i];
+        table->miss = new_offset[table->miss];
+        for (int t = 0; t < table->capacity; ++t) {
+            if (table->targets[t] >= 0) {
+                table->targets[t] = new_offset[table->targets[t]];
+            }
+        }
+    }
+
+    bytecode_chunk out;
+    init_bytecode_chunk(&out);
+
+    for (int i = 0; i < list->count; ++i) {
+        instruction* instr = &list->code[i];
+        if (instr->removed) {
+            continue;
+        }
+
+        uint8_t op = encoded_op(instr);
+        write_to_bytecode_chunk(&out, op, instr->line);
+
+        if (is_jump(instr->op)) {
+            int end = new_offset[i] + opcode_length(op);
+            int destination = new_offset[instr->target];
+            int jump = instr->op == OP_LOOP ? end - destination : destination - end;
+            if (instr->wide) {
+                u24_t operand = construct_u24_t(jump);
+                write_to_bytecode_chunk(&out, operand.hi, instr->line);
+                write_to_bytecode_chunk(&out, operand.mid, instr->line);
+                write_to_bytecode_chunk(&out, operand.lo, instr->line);
+            } else {
+                write_to_bytecode_chunk(&out, (jump >> 8) & 0xFF, instr->line);
+                write_to_bytecode_chunk(&out, jump & 0xFF, instr->line);
+            }
+            continue;
+        }
+
+        for (int b = 1; b < opcode_length(op); ++b) {
+            write_to_bytecode_chunk(&out, instr->operands[b - 1], instr->line);
+        }
+    }
+
+    FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
+    FREE_ARRAY(line_run, chunk->line_runs, chunk->lr_capacity);
+    chunk->count = out.count;
+    chunk->capacity = out.capacity;
+    chunk->code = out.code;
+    chunk->lr_count = out.lr_count;
+    chunk->lr_capacity = out.lr_capacity;
+    chunk->line_runs = out.line_runs;
+}
+
+static void rewrite_chunk(bytecode_chunk* chunk, const far_jump* far_jumps, int far_jump_count,
+                          bool optimize) {
+    if (chunk->count == 0) {
+        return;
+    }
+
+    // Every instruction is at least one byte, so the chunk's size bounds the instruction count.
+    int capacity = chunk->count + 1;
+    instruction_list list;
+    list.code = ALLOCATE(instruction, capacity);
+    list.count = 0;
+    list.chunk = chunk;
+    int* offsets = ALLOCATE(int, capacity);
+
+    decode(chunk, &list, offsets, far_jumps, far_jump_count);
+
+    bool changed = optimize;
+    while (changed) {
+        mark_targets(&list);
+        changed = fuse_comparisons(&list);
+        changed |= fuse_pop_jumps(&list);
+        changed |= thread_jumps(&list);
+        changed |= remove_empty_jumps(&list);
+
+        mark_targets(&list);
+        changed |= remove_dead_code(&list);
+    }
+
+    if (optimize) {
+        mark_targets(&list);
+        form_superinstructions(&list);
+    }
+
+    encode(chunk, &list, offsets);
+
+    FREE_ARRAY(instruction, list.code, capacity);
+    FREE_ARRAY(int, offsets, capacity);
+}
+
+void optimize_chunk(bytecode_chunk* chunk) {
+    // Only OP_JUMP, OP_JUMP_IF_FALSE and OP_LOOP have wide forms, not the jumps the rewrites fuse
+    // them into.  None of those can end up needing one as long as the whole chunk fits in 16 bits,
+    // and nothing here makes code bigger, so larger chunks are left alone.
+    if (chunk->count > UINT16_MAX) {
+        return;
+    }
+    rewrite_chunk(chunk, NULL, 0, true);
+}
+
+void widen_jumps(bytecode_chunk* chunk, const far_jump* far_jumps, int far_jump_count) {
+    rewrite_chunk(chunk, far_jumps, far_jump_count, false);
+}
@@ -0,0 +1,14 @@
+#ifndef JUMI_CLOX_OPTIMIZER_H
+#define JUMI_CLOX_OPTIMIZER_H
+#include "bytecode_chunk.h"
+
+// A forward jump that turned out too far for its 16 bit operand, which was left unpatched.
+typedef struct {
+    int offset;
+    int target;
+} far_jump;
+
+void optimize_chunk(bytecode_chunk* chunk);
+void widen_jumps(bytecode_chunk* chunk, const far_jump* far_jumps, int far_jump_count);
+
+#endif
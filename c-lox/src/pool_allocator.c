@@ -0,0 +1,123 @@
+#include "pool_allocator.h"
+#include <stdlib.h>
+#include <string.h>
+
+// Every size class carves its blocks out of its own slabs.  A fresh slab is handed out by bumping
+// a cursor, and freed blocks are threaded onto the class's free list, which is always preferred
+// over the cursor so recently freed (and still cached) memory is reused first.
+
+typedef struct free_block {
+    struct free_block* next;
+} free_block;
+
+typedef struct slab {
+    struct slab* next;
+} slab;
+
+typedef struct {
+    free_block* free_list;
+    uint8_t* cursor;
+    uint8_t* end;
+} size_class;
+
+static size_class classes[POOL_CLASS_COUNT];
+static slab* slabs = NULL;
+
+static void* system_reallocate(void* pointer, size_t new_size) {
+    if (new_size == 0) {
+        free(pointer);
+        return NULL;
+    }
+
+    void* result = realloc(pointer, new_size);
+    if (result == NULL) {
+        exit(EXIT_FAILURE);
+    }
+    return result;
+}
+
+static int class_index(size_t size) { return (int)((size + POOL_GRANULE - 1) / POOL_GRANULE) - 1; }
+
+static size_t class_size(int index) { return (size_t)(index + 1) * POOL_GRANULE; }
+
+static void new_slab(size_class* sc) {
+    // The slab header sits at the front of the page so all slabs can be released at exit.
+    slab* page = (slab*)system_reallocate(NULL, POOL_SLAB_SIZE);
+    page->next = slabs;
+    slabs = page;
+
+    sc->cursor = (uint8_t*)page + POOL_GRANULE;
+    sc->end = (uint8_t*)page + POOL_SLAB_SIZE;
+}
+
+static void* pool_allocate(size_t size) {
+    int index = class_index(size);
+    size_class* sc = &classes[index];
+
+    if (sc->free_list != NULL) {
+        free_block* block = sc->free_list;
+        sc->free_list = block->next;
+        return block;
+    }
+
+    size_t block_size = class_size(index);
+    if (sc->cursor == NULL || sc->cursor + block_size > sc->end) {
+        new_slab(sc);
+    }
+
+    void* block = sc->cursor;
+    sc->cursor += block_size;
+    return block;
+}
+
+static void pool_free(void* pointer, size_t size) {
+    size_class* sc = &classes[class_index(size)];
+    free_block* block = (free_block*)pointer;
+    block->next = sc->free_list;
+    sc->free_list = block;
+}
+
+void* pool_reallocate(void* pointer, size_t old_size, size_t new_size) {
+    bool old_pooled = pointer != NULL && old_size > 0 && old_size <= POOL_MAX_SIZE;
+    bool new_pooled = new_size > 0 && new_size <= POOL_MAX_SIZE;
+
+    if (!old_pooled && !new_pooled) {
+        return system_reallocate(pointer, new_size);
+    }
+
+    // Staying inside the same size class needs no work at all.
+    if (old_pooled && new_pooled && class_index(old_size) == class_index(new_size)) {
+        return pointer;
+    }
+
+    void* result = NULL;
+    if (new_pooled) {
+        result = pool_allocate(new_size);
+    } else if (new_size > 0) {
+        result = system_reallocate(NULL, new_size);
+    }
+
+    if (pointer != NULL) {
+        if (result != NULL) {
+            memcpy(result, pointer, old_size < new_size ? old_size : new_size);
+        }
+
+        if (old_pooled) {
+            pool_free(pointer, old_size);
+        } else {
+            free(pointer);
+        }
+    }
+
+    return result;
+}
+
+void pool_release_all(void) {
+    while (slabs != NULL) {
+        slab* next = slabs->next;
+        free(slabs);
+        slabs = next;
+    }
+
+    memset(classes, 0, sizeof(classes));
+}
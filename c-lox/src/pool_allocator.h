@@ -0,0 +1,17 @@
+#ifndef JUMI_CLOX_POOL_ALLOCATOR_H
+#define JUMI_CLOX_POOL_ALLOCATOR_H
+#include "common.h"
+
+// Size classes are POOL_GRANULE bytes apart up to POOL_MAX_SIZE, anything bigger goes straight to
+// the system allocator.
+#define POOL_GRANULE 16
+#define POOL_MAX_SIZE 256
+#define POOL_CLASS_COUNT (POOL_MAX_SIZE / POOL_GRANULE)
+#define POOL_SLAB_SIZE (64 * 1024)
+
+// Same contract as reallocate(): the caller always passes the exact size it allocated, which is
+// what lets the pool keep no per-block header.
+void* pool_reallocate(void* pointer, size_t old_size, size_t new_size);
+void pool_release_all(void);
+
+#endif
@@ -56,9 +56,67 @@ static clox_value get_line_native(int argc, clox_value* args) {
     return OBJECT_VALUE(s);
 }
 
+static clox_value len_native(int argc, clox_value* args) {
+    if (IS_LIST(args[0])) {
+        int length;
+        list_values(AS_LIST(args[0]), &length);
+        return NUMBER_VALUE(length);
+    }
+    NATIVE_REQUIRE(IS_STRING(args[0]), "len expects a list or a string.");
+    return NUMBER_VALUE(AS_STRING(args[0])->length);
+}
+
+// Lists that push, pop and insert can change the length of, which slices can't.
+#define NATIVE_REQUIRE_RESIZABLE(val, name)                                                        \
+    do {                                                                                           \
+        NATIVE_REQUIRE(IS_LIST(val), name " expects a list.");                                     \
+        NATIVE_REQUIRE(AS_LIST(val)->base == NULL, name " can't change the length of a slice.");   \
+    } while (false)
+
+static clox_value push_native(int argc, clox_value* args) {
+    NATIVE_REQUIRE_RESIZABLE(args[0], "push");
+    list_append(AS_LIST(args[0]), args[1]);
+    return NULL_VALUE;
+}
+
+static clox_value pop_native(int argc, clox_value* args) {
+    NATIVE_REQUIRE_RESIZABLE(args[0], "pop");
+    object_list* list = AS_LIST(args[0]);
+    NATIVE_REQUIRE(list->items.count > 0, "pop from an empty list.");
+    return list->items.values[--list->items.count];
+}
+
+static clox_value insert_native(int argc, clox_value* args) {
+    NATIVE_REQUIRE_RESIZABLE(args[0], "insert");
+    object_list* list = AS_LIST(args[0]);
+    // Inserting at the length appends.
+    int index = list_slot(args[1], list->items.count + 1);
+    NATIVE_REQUIRE(index >= 0, "insert index out of bounds.");
+    list_insert(list, index, args[2]);
+    return NULL_VALUE;
+}
+
+// slice(list, start, end = len(list)) views the values from 'start' up to, not including, 'end'.
+static clox_value slice_native(int argc, clox_value* args) {
+    NATIVE_REQUIRE(IS_LIST(args[0]), "slice expects a list.");
+    object_list* list = AS_LIST(args[0]);
+    int length;
+    list_values(list, &length);
+
+    int start = list_slot(args[1], length + 1);
+    int end = argc == 3 ? list_slot(args[2], length + 1) : length;
+    NATIVE_REQUIRE(start >= 0 && end >= start, "slice bounds out of range.");
+    return OBJECT_VALUE(new_list_slice(list, start, end - start));
+}
+
 void stdlib_init(void) {
     virtual_machine_register_native("clock", clock_native, 0, 0);
     virtual_machine_register_native("print", print_native, NATIVE_VARARGS);
     virtual_machine_register_native("println", println_native, NATIVE_VARARGS);
     virtual_machine_register_native("get_line", get_line_native, 0, 1);
+    virtual_machine_register_native("len", len_native, 1, 1);
+    virtual_machine_register_native("push", push_native, 2, 2);
+    virtual_machine_register_native("pop", pop_native, 1, 1);
+    virtual_machine_register_native("insert", insert_native, 3, 3);
+    virtual_machine_register_native("slice", slice_native, 2, 3);
 }
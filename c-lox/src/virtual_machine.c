@@ -12,8 +12,61 @@
 #include <string.h>
 #include <time.h>
 
+// CLOX_COMPUTED_GOTO is requested at configure time, but only honoured on compilers that support
+// taking the address of a label.
+#if defined(CLOX_COMPUTED_GOTO) && defined(__GNUC__)
+#define CLOX_USE_COMPUTED_GOTO
+#endif
+
 virtual_machine vm;
 
+#ifdef DEBUG_PROFILE_OPCODES
+// How often each opcode ran straight after each other one, printed when the process exits.  Used to
+// pick which pairs are worth a superinstruction.
+#define PROFILE_REPORT_PAIRS 24
+
+static uint64_t opcode_pair_counts[UINT8_COUNT][UINT8_COUNT];
+static uint8_t previous_opcode = OP_RETURN;
+
+static void record_opcode(uint8_t op) {
+    ++opcode_pair_counts[previous_opcode][op];
+    previous_opcode = op;
+}
+
+static void print_opcode_profile(void) {
+    uint64_t total = 0;
+    for (int a = 0; a < UINT8_COUNT; ++a) {
+        for (int b = 0; b < UINT8_COUNT; ++b) {
+            total += opcode_pair_counts[a][b];
+        }
+    }
+
+    fprintf(stderr, "== opcode pairs (%llu instructions) ==\n", (unsigned long long)total);
+    for (int rank = 0; rank < PROFILE_REPORT_PAIRS && total > 0; ++rank) {
+        int best_a = 0;
+        int best_b = 0;
+        for (int a = 0; a < UINT8_COUNT; ++a) {
+            for (int b = 0; b < UINT8_COUNT; ++b) {
+                if (opcode_pair_counts[a][b] > opcode_pair_counts[best_a][best_b]) {
+                    best_a = a;
+                    best_b = b;
+                }
+            }
+        }
+
+        uint64_t count = opcode_pair_counts[best_a][best_b];
+        if (count == 0) {
+            break;
+        }
+
+        fprintf(stderr, "%12llu %5.1f%%  %s %s\n", (unsigned long long)count,
+                100.0 * (double)count / (double)total, opcode_name(best_a), opcode_name(best_b));
+        // Ranked by repeatedly taking the largest, so clear it once it has been reported.
+        opcode_pair_counts[best_a][best_b] = 0;
+    }
+}
+#endif
+
 void virtual_machine_native_errorf(const char* fmt, ...) {
     vm.native_failed = true;
     va_list args;
@@ -26,7 +79,11 @@ void virtual_machine_register_native(const char* name, native_fn function, int m
                                      int max_arity) {
     virtual_machine_stack_push(OBJECT_VALUE(copy_string(name, (int)strlen(name))));
     virtual_machine_stack_push(OBJECT_VALUE(new_native(function, name, min_arity, max_arity)));
-    hash_table_set(&vm.global_variables, AS_STRING(vm.stack[0]), vm.stack[1]);
+    // Resolve the slot first, it may grow (and move) the globals array.
+    int slot = virtual_machine_global_slot(AS_STRING(vm.stack[0]));
+    global_variable* global = &vm.globals[slot];
+    global->val = vm.stack[1];
+    global->is_defined = true;
     virtual_machine_stack_pop();
     virtual_machine_stack_pop();
 }
@@ -60,16 +117,16 @@ static void dump_global_variables(void) {
     printf("global variables: [");
     bool first = true;
 
-    for (int i = 0; i < vm.global_variables.capacity; ++i) {
-        table_entry* entry = &vm.global_variables.entries[i];
-        if (entry->key != NULL) {
+    for (int i = 0; i < vm.global_count; ++i) {
+        global_variable* global = &vm.globals[i];
+        if (global->is_defined) {
             if (!first) {
                 printf(", ");
             }
             printf("{");
-            print_string(entry->key);
+            print_string(global->name);
             printf(":");
-            print_value(entry->val);
+            print_value(global->val);
             printf("}");
             first = false;
         }
@@ -96,18 +153,44 @@ static void dump_interned_strings(void) {
     printf("]\n");
 }
 
+static void print_inline_cache_stats(void) {
+    inline_cache_stats* stats = &vm.inline_caches;
+    uint64_t total =
+        stats->monomorphic_hits + stats->polymorphic_hits + stats->misses + stats->megamorphic;
+    double percent = total > 0 ? 100.0 / (double)total : 0.0;
+
+    printf("property caches: %llu accesses, %.1f%% monomorphic hits, %.1f%% polymorphic hits, "
+           "%.1f%% misses, %.1f%% megamorphic\n",
+           (unsigned long long)total, (double)stats->monomorphic_hits * percent,
+           (double)stats->polymorphic_hits * percent, (double)stats->misses * percent,
+           (double)stats->megamorphic * percent);
+
+    uint64_t calls = stats->method_hits + stats->method_misses;
+    double call_percent = calls > 0 ? 100.0 / (double)calls : 0.0;
+    printf("method caches: %llu calls, %.1f%% hits, %.1f%% misses\n", (unsigned long long)calls,
+           (double)stats->method_hits * call_percent,
+           (double)stats->method_misses * call_percent);
+}
+
 static void virtual_machine_debug(call_frame* frame) {
     printf("===== DEBUG =====\n");
     dump_constant_table(frame);
     dump_stack();
     dump_global_variables();
     dump_interned_strings();
+    hash_table_print_stats("interned strings table", &vm.interned_strings);
+    hash_table_print_stats("global names table", &vm.global_names);
+    print_gc_stats();
+    print_inline_cache_stats();
     printf("===== END DEBUG =====\n");
 }
 
+#define TRACE_FRAMES_SHOWN 16
+
 static void reset_stack(void) {
     vm.stack_top = vm.stack;
     vm.frame_count = 0;
+    vm.open_upvalues = NULL;
 }
 
 static void runtime_error(const char* format, ...) {
@@ -119,6 +202,13 @@ static void runtime_error(const char* format, ...) {
 
     fprintf(stderr, "== stack trace ==\n");
     for (int i = vm.frame_count - 1; i >= 0; --i) {
+        // A stack overflow can be tens of thousands of frames deep, only the ends of it are useful.
+        if (i == vm.frame_count - 1 - TRACE_FRAMES_SHOWN && i >= TRACE_FRAMES_SHOWN) {
+            fprintf(stderr, "[... %d more frames ...]\n", i + 1 - TRACE_FRAMES_SHOWN);
+            i = TRACE_FRAMES_SHOWN;
+            continue;
+        }
+
         call_frame* frame = &vm.frames[i];
         object_function* function = frame->function;
         size_t instruction = frame->ip - function->chunk.code - 1;
@@ -134,31 +224,189 @@ static void runtime_error(const char* format, ...) {
     reset_stack();
 }
 
-static clox_value virtual_machine_stack_peek(int distance) { return vm.stack_top[-1 - distance]; }
+// Makes room for at least 'needed' values above stack_top.  The stack moves when it grows, so it
+// is copied rather than reallocated, which keeps the old array around long enough to rebase every
+// frame's slots onto the new one.
+static void grow_stack(int needed) {
+    int used = (int)(vm.stack_top - vm.stack);
+    int capacity = vm.stack_capacity;
+    while (capacity < used + needed) {
+        capacity = GROW_CAPACITY(capacity);
+    }
+
+    clox_value* stack = ALLOCATE(clox_value, capacity);
+    if (used > 0) {
+        memcpy(stack, vm.stack, sizeof(clox_value) * (size_t)used);
+    }
+    for (int i = 0; i < vm.frame_count; ++i) {
+        vm.frames[i].slots = stack + (vm.frames[i].slots - vm.stack);
+    }
+    for (object_upvalue* upvalue = vm.open_upvalues; upvalue != NULL; upvalue = upvalue->next) {
+        upvalue->location = stack + (upvalue->location - vm.stack);
+    }
 
-static bool call_function(object_function* function, int arg_count) {
+    FREE_ARRAY(clox_value, vm.stack, vm.stack_capacity);
+    vm.stack = stack;
+    vm.stack_top = stack + used;
+    vm.stack_capacity = capacity;
+}
+
+static void grow_frames(void) {
+    int old_capacity = vm.frame_capacity;
+    vm.frame_capacity = GROW_CAPACITY(old_capacity);
+    if (vm.frame_capacity > FRAMES_MAX) {
+        vm.frame_capacity = FRAMES_MAX;
+    }
+    vm.frames = GROW_ARRAY(call_frame, vm.frames, old_capacity, vm.frame_capacity);
+}
+
+// Makes sure the function about to run on top of the callee and its 'arg_count' arguments has all
+// the stack it can use.
+static void reserve_stack(object_function* function, int arg_count) {
+    int needed = function->max_stack - (arg_count + 1) + STACK_RESERVE;
+    if (vm.stack_top + needed > vm.stack + vm.stack_capacity) {
+        grow_stack(needed);
+    }
+}
+
+// Returns the open upvalue for 'slot', creating it if no closure has captured the slot yet, so
+// every closure over the same variable shares it.
+static object_upvalue* capture_upvalue(clox_value* slot) {
+    object_upvalue* previous = NULL;
+    object_upvalue* upvalue = vm.open_upvalues;
+    while (upvalue != NULL && upvalue->location > slot) {
+        previous = upvalue;
+        upvalue = upvalue->next;
+    }
+
+    if (upvalue != NULL && upvalue->location == slot) {
+        return upvalue;
+    }
+
+    object_upvalue* created = new_upvalue(slot);
+    created->next = upvalue;
+    if (previous == NULL) {
+        vm.open_upvalues = created;
+    } else {
+        previous->next = created;
+    }
+    return created;
+}
+
+// Closes every open upvalue at or above 'last', moving the variables they point at off the stack.
+static void close_upvalues(clox_value* last) {
+    while (vm.open_upvalues != NULL && vm.open_upvalues->location >= last) {
+        object_upvalue* upvalue = vm.open_upvalues;
+        upvalue->closed = *upvalue->location;
+        upvalue->location = &upvalue->closed;
+        write_barrier((object*)upvalue, upvalue->closed);
+        vm.open_upvalues = upvalue->next;
+    }
+}
+
+// The only stack check a call makes: the callee's max_stack bounds everything its own code can
+// push, so the interpreter loop never has to look.
+static inline bool call_function(object_function* function, object_closure* closure,
+                                 int arg_count) {
     if (arg_count != function->arity) {
         runtime_error("Expected %d arguments but got %d.", function->arity, arg_count);
         return false;
     }
 
-    if (vm.frame_count == FRAMES_MAX) {
-        runtime_error("== STACK OVERFLOW ==");
-        return false;
+    if (vm.frame_count == vm.frame_capacity) {
+        if (vm.frame_count == FRAMES_MAX) {
+            runtime_error("== STACK OVERFLOW ==");
+            return false;
+        }
+        grow_frames();
     }
 
+    reserve_stack(function, arg_count);
+
     call_frame* frame = &vm.frames[vm.frame_count++];
     frame->function = function;
+    frame->closure = closure;
     frame->ip = function->chunk.code;
     frame->slots = vm.stack_top - arg_count - 1;
     return true;
 }
 
+// A call in tail position reuses the caller's frame: nothing in it is needed once the callee
+// returns, so the callee and its arguments slide down over its slots and the frame starts over on
+// the new function.  Closures still holding on to its locals get their own copies first.
+static bool tail_call_function(object_function* function, object_closure* closure,
+                               int arg_count) {
+    if (arg_count != function->arity) {
+        runtime_error("Expected %d arguments but got %d.", function->arity, arg_count);
+        return false;
+    }
+
+    call_frame* frame = &vm.frames[vm.frame_count - 1];
+    close_upvalues(frame->slots);
+    clox_value* callee = vm.stack_top - arg_count - 1;
+    memmove(frame->slots, callee, sizeof(clox_value) * (size_t)(arg_count + 1));
+    vm.stack_top = frame->slots + arg_count + 1;
+
+    reserve_stack(function, arg_count);
+
+    frame->function = function;
+    frame->closure = closure;
+    frame->ip = function->chunk.code;
+    return true;
+}
+
+// Pushes a new closure over 'function', capturing its upvalues from 'frame', the one creating it.
+static void push_closure(call_frame* frame, object_function* function) {
+    object_closure* closure = new_closure(function);
+    virtual_machine_stack_push(OBJECT_VALUE(closure));
+
+    for (int i = 0; i < closure->upvalue_count; ++i) {
+        upvalue_capture* capture = &function->captures[i];
+        object_upvalue* upvalue = capture->is_local ? capture_upvalue(frame->slots + capture->index)
+                                                    : frame->closure->upvalues[capture->index];
+        closure->upvalues[i] = upvalue;
+        write_barrier((object*)closure, OBJECT_VALUE(upvalue));
+    }
+}
+
+// Calls a method, which is a function unless it captures anything, with the receiver already in
+// the callee's slot.
+static bool call_method(clox_value method, int arg_count) {
+    if (IS_CLOSURE(method)) {
+        object_closure* closure = AS_CLOSURE(method);
+        return call_function(closure->function, closure, arg_count);
+    }
+    return call_function(AS_FUNCTION(method), NULL, arg_count);
+}
+
 static bool call_value(clox_value callee, int arg_count) {
     if (IS_OBJECT(callee)) {
         switch (OBJECT_TYPE(callee)) {
+            case OBJECT_BOUND_METHOD: {
+                object_bound_method* bound = AS_BOUND_METHOD(callee);
+                vm.stack_top[-arg_count - 1] = bound->receiver;
+                return call_method(bound->method, arg_count);
+            } break;
+            case OBJECT_CLASS: {
+                object_class* klass = AS_CLASS(callee);
+                vm.stack_top[-arg_count - 1] = OBJECT_VALUE(new_instance(klass));
+
+                clox_value initializer;
+                if (hash_table_get(&klass->methods, vm.init_string, &initializer)) {
+                    return call_method(initializer, arg_count);
+                }
+                if (arg_count != 0) {
+                    runtime_error("Expected 0 arguments but got %d.", arg_count);
+                    return false;
+                }
+                return true;
+            } break;
+            case OBJECT_CLOSURE: {
+                object_closure* closure = AS_CLOSURE(callee);
+                return call_function(closure->function, closure, arg_count);
+            } break;
             case OBJECT_FUNCTION: {
-                return call_function(AS_FUNCTION(callee), arg_count);
+                return call_function(AS_FUNCTION(callee), NULL, arg_count);
             } break;
             case OBJECT_NATIVE: {
                 object_native* native = AS_NATIVE(callee);
@@ -190,43 +438,250 @@ static bool call_value(clox_value callee, int arg_count) {
     return false;
 }
 
+// Calls the method for an OP_INVOKE whose cache missed, and caches it for the receiver's class and
+// shape.  A field with the same name shadows the method and is called instead, uncached.
+static bool invoke_uncached(object_function* function, method_cache* cache, int arg_count) {
+    clox_value receiver = vm.stack_top[-arg_count - 1];
+    if (!IS_INSTANCE(receiver)) {
+        runtime_error("Only instances have methods.");
+        return false;
+    }
+
+    object_instance* instance = AS_INSTANCE(receiver);
+    int slot = shape_slot(instance->shape, cache->name);
+    if (slot >= 0) {
+        clox_value field = instance->fields[slot];
+        vm.stack_top[-arg_count - 1] = field;
+        return call_value(field, arg_count);
+    }
+
+    clox_value method;
+    if (!hash_table_get(&instance->klass->methods, cache->name, &method)) {
+        runtime_error("Undefined property '%s'.", cache->name->chars);
+        return false;
+    }
+
+    ++vm.inline_caches.method_misses;
+    cache->klass = instance->klass;
+    cache->shape = instance->shape;
+    cache->method = method;
+    write_barrier((object*)function, OBJECT_VALUE(instance->klass));
+    return call_method(method, arg_count);
+}
+
+// The same for an OP_SUPER_INVOKE, where only the superclass matters.
+static bool super_invoke_uncached(object_function* function, method_cache* cache,
+                                  object_class* superclass, int arg_count) {
+    clox_value method;
+    if (!hash_table_get(&superclass->methods, cache->name, &method)) {
+        runtime_error("Undefined property '%s'.", cache->name->chars);
+        return false;
+    }
+
+    ++vm.inline_caches.method_misses;
+    cache->klass = superclass;
+    cache->method = method;
+    write_barrier((object*)function, OBJECT_VALUE(superclass));
+    return call_method(method, arg_count);
+}
+
+// Why list_slot() turned 'index' down.
+static void list_index_error(clox_value index, int length) {
+    if (!IS_NUMBER(index)) {
+        runtime_error("List index must be a number.");
+    } else if (AS_NUMBER(index) >= 0 && AS_NUMBER(index) < length) {
+        runtime_error("List index must be a whole number.");
+    } else {
+        runtime_error("List index %g is out of bounds for a list of length %d.", AS_NUMBER(index),
+                      length);
+    }
+}
+
+// Replaces the instance on top of the stack with its method 'name' from 'klass', bound to it.
+static bool bind_method(object_class* klass, object_string* name) {
+    clox_value method;
+    if (!hash_table_get(&klass->methods, name, &method)) {
+        runtime_error("Undefined property '%s'.", name->chars);
+        return false;
+    }
+
+    object_bound_method* bound = new_bound_method(vm.stack_top[-1], method);
+    vm.stack_top[-1] = OBJECT_VALUE(bound);
+    return true;
+}
+
+// Fills the next free entry of 'cache', unless it has run out and the access is megamorphic.
+static void cache_property(property_cache* cache, object_shape* shape, object_shape* transition,
+                           int slot) {
+    if (cache->count == PROPERTY_CACHE_ENTRIES) {
+        ++vm.inline_caches.megamorphic;
+        return;
+    }
+
+    ++vm.inline_caches.misses;
+    cache->entries[cache->count++] =
+        (property_cache_entry){.shape = shape, .transition = transition, .slot = slot};
+}
+
+// Reads the property for an OP_GET_PROPERTY whose first cache entry missed, replacing the
+// instance on top of the stack with it.  A name that isn't a field is a method, bound to the
+// instance, and isn't cached.
+static bool get_property_uncached(property_cache* cache, object_instance* instance) {
+    object_shape* shape = instance->shape;
+    for (int i = 1; i < cache->count; ++i) {
+        if (cache->entries[i].shape == shape) {
+            ++vm.inline_caches.polymorphic_hits;
+            vm.stack_top[-1] = instance->fields[cache->entries[i].slot];
+            return true;
+        }
+    }
+
+    int slot = shape_slot(shape, cache->name);
+    if (slot < 0) {
+        return bind_method(instance->klass, cache->name);
+    }
+
+    cache_property(cache, shape, NULL, slot);
+    vm.stack_top[-1] = instance->fields[slot];
+    return true;
+}
+
+// Stores the property for an OP_SET_PROPERTY whose first cache entry missed.  The instance and
+// the value are still on the stack.
+static void set_property_uncached(property_cache* cache, object_instance* instance,
+                                  clox_value val) {
+    object_shape* shape = instance->shape;
+    for (int i = 0; i < cache->count; ++i) {
+        property_cache_entry* entry = &cache->entries[i];
+        if (entry->shape != shape) {
+            continue;
+        }
+        // Known, but the field array has to grow first.
+        if (entry->slot >= instance->field_capacity) {
+            instance_set_field(instance, cache->name, val);
+            return;
+        }
+
+        ++vm.inline_caches.polymorphic_hits;
+        if (entry->transition != NULL) {
+            instance->shape = entry->transition;
+            write_barrier((object*)instance, OBJECT_VALUE(entry->transition));
+        }
+        instance->fields[entry->slot] = val;
+        write_barrier((object*)instance, val);
+        return;
+    }
+
+    int slot = instance_set_field(instance, cache->name, val);
+    cache_property(cache, shape, instance->shape != shape ? instance->shape : NULL, slot);
+}
+
 static bool is_falsey(clox_value value) {
     return IS_NULL(value) || (IS_BOOL(value) && !AS_BOOL(value));
 }
 
 static void concatenate_string(void) {
-    object_string* b = AS_STRING(virtual_machine_stack_pop());
-    object_string* a = AS_STRING(virtual_machine_stack_pop());
+    // The operands stay on the stack until the result exists, so a collection triggered by either
+    // allocation below can't free them.
+    object_string* b = AS_STRING(vm.stack_top[-1]);
+    object_string* a = AS_STRING(vm.stack_top[-2]);
 
-    int length = b->length + a->length;
-    char* chars = ALLOCATE(char, length + 1);
-    memcpy(chars, a->chars, a->length);
-    memcpy(chars + a->length, b->chars, b->length);
-    chars[length] = '\0';
+    object_string* result = allocate_string_buffer(a->length + b->length);
+    memcpy(result->chars, a->chars, a->length);
+    memcpy(result->chars + a->length, b->chars, b->length);
 
-    object_string* result = take_string(chars, length);
+    result = take_string(result);
+    virtual_machine_stack_pop();
+    virtual_machine_stack_pop();
     virtual_machine_stack_push(OBJECT_VALUE(result));
 }
 
+int virtual_machine_global_slot(object_string* name) {
+    clox_value index;
+    if (hash_table_get(&vm.global_names, name, &index)) {
+        return (int)AS_NUMBER(index);
+    }
+
+    // The name isn't reachable from any root until the slot exists.
+    virtual_machine_stack_push(OBJECT_VALUE(name));
+
+    if (vm.global_count >= vm.global_capacity) {
+        int old_capacity = vm.global_capacity;
+        vm.global_capacity = GROW_CAPACITY(old_capacity);
+        vm.globals = GROW_ARRAY(global_variable, vm.globals, old_capacity, vm.global_capacity);
+    }
+
+    global_variable* global = &vm.globals[vm.global_count];
+    global->name = name;
+    global->val = NULL_VALUE;
+    global->is_defined = false;
+    global->is_const = false;
+    ++vm.global_count;
+    hash_table_set(&vm.global_names, name, NUMBER_VALUE((double)(vm.global_count - 1)));
+
+    virtual_machine_stack_pop();
+    return vm.global_count - 1;
+}
+
 void init_virtual_machine(void) {
     reset_stack();
     vm.objects = NULL;
-    init_hash_table(&vm.global_variables);
-    init_hash_table(&vm.global_consts);
+    vm.bytes_allocated = 0;
+    vm.next_gc = 1024 * 1024;
+    vm.gray_count = 0;
+    vm.gray_capacity = 0;
+    vm.gray_stack = NULL;
+    memset(&vm.gc, 0, sizeof(vm.gc));
+    memset(&vm.inline_caches, 0, sizeof(vm.inline_caches));
+#ifdef CLOX_GC_GENERATIONAL
+    vm.old_objects = NULL;
+    vm.sweep_objects = NULL;
+    vm.gc_phase = GC_IDLE;
+    vm.gc_minor = false;
+    vm.bytes_since_minor = 0;
+    vm.remembered_count = 0;
+    vm.remembered_capacity = 0;
+    vm.remembered = NULL;
+#endif
+    vm.globals = NULL;
+    vm.global_count = 0;
+    vm.global_capacity = 0;
+    init_hash_table(&vm.global_names);
     init_hash_table(&vm.interned_strings);
+    vm.init_string = NULL;
+    vm.empty_shape = NULL;
 
+    vm.stack = NULL;
+    vm.stack_capacity = 0;
+    vm.frames = NULL;
+    vm.frame_capacity = 0;
+    reset_stack();
+    grow_stack(STACK_INITIAL);
+    vm.frames = ALLOCATE(call_frame, FRAMES_INITIAL);
+    vm.frame_capacity = FRAMES_INITIAL;
+
+    vm.init_string = copy_string("init", 4);
+    vm.empty_shape = new_shape();
     stdlib_init();
+
+#ifdef DEBUG_PROFILE_OPCODES
+    atexit(print_opcode_profile);
+#endif
 }
 
 void free_virtual_machine(void) {
-    free_hash_table(&vm.global_variables);
-    free_hash_table(&vm.global_consts);
+    FREE_ARRAY(clox_value, vm.stack, vm.stack_capacity);
+    FREE_ARRAY(call_frame, vm.frames, vm.frame_capacity);
+    FREE_ARRAY(global_variable, vm.globals, vm.global_capacity);
+    free_hash_table(&vm.global_names);
     free_hash_table(&vm.interned_strings);
+    vm.init_string = NULL;
+    vm.empty_shape = NULL;
     free_objects();
 }
 
+// Pushes from outside the interpreter loop are covered by STACK_RESERVE.
 void virtual_machine_stack_push(clox_value val) {
-    // Maybe handle stack overflow here.
     *vm.stack_top = val;
     ++vm.stack_top;
 }
@@ -236,244 +691,782 @@ clox_value virtual_machine_stack_pop(void) {
     return *vm.stack_top;
 }
 
-static int READ_U24(call_frame* frame) {
-    u24_t u24_index;
-    u24_index.hi = *frame->ip++;
-    u24_index.mid = *frame->ip++;
-    u24_index.lo = *frame->ip++;
-    return deconstruct_u24_t(u24_index);
-}
+// Computed goto and the '[first ... last]' range initializer are GNU extensions, which the
+// project-wide -pedantic-errors would otherwise reject.
+#ifdef CLOX_USE_COMPUTED_GOTO
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"
+#if defined(__clang__)
+#pragma GCC diagnostic ignored "-Winitializer-overrides"
+#else
+#pragma GCC diagnostic ignored "-Woverride-init"
+#endif
+#endif
 
 static interpret_result virtual_machine_run(void) {
+    // The hot interpreter state lives in locals so the compiler can keep it in registers. It is
+    // only written back to the frame and the vm (SYNC_STATE) before anything outside this function
+    // looks at it: calls, returns, natives, string allocation and runtime errors.
     call_frame* frame = &vm.frames[vm.frame_count - 1];
+    uint8_t* ip = frame->ip;
+    clox_value* slots = frame->slots;
+    clox_value* stack_top = vm.stack_top;
 
-#define READ_BYTE() (*frame->ip++)
-#define READ_SHORT() (frame->ip += 2, (uint16_t)((frame->ip[-2] << 8) | frame->ip[-1]))
+#define SYNC_STATE()                                                                               \
+    do {                                                                                           \
+        frame->ip = ip;                                                                            \
+        vm.stack_top = stack_top;                                                                  \
+    } while (false)
+#define RELOAD_STATE()                                                                             \
+    do {                                                                                           \
+        frame = &vm.frames[vm.frame_count - 1];                                                    \
+        ip = frame->ip;                                                                            \
+        slots = frame->slots;                                                                      \
+        stack_top = vm.stack_top;                                                                  \
+    } while (false)
+#define RUNTIME_ERROR(...)                                                                         \
+    do {                                                                                           \
+        SYNC_STATE();                                                                              \
+        runtime_error(__VA_ARGS__);                                                                \
+        return INTERPRET_RUNTIME_ERROR;                                                            \
+    } while (false)
+
+#define PUSH(val) (*stack_top++ = (val))
+#define POP() (*--stack_top)
+#define PEEK(distance) (stack_top[-1 - (distance)])
+
+#define READ_BYTE() (*ip++)
+#define READ_SHORT() (ip += 2, (uint16_t)((ip[-2] << 8) | ip[-1]))
+#define READ_U24() (ip += 3, deconstruct_u24_t((u24_t){.hi = ip[-3], .mid = ip[-2], .lo = ip[-1]}))
+// Rewrites the instruction that was just read, so the next time it runs it dispatches to 'op'.
+#define QUICKEN(op) (ip[-1] = (op))
+// Hands the instruction back to its generic form and steps back onto it, so that dispatching next
+// runs the generic handler on the same operands.
+#define DEOPTIMIZE(op) (*--ip = (op))
 #define READ_CONSTANT() (frame->function->chunk.constants.values[READ_BYTE()])
+#define READ_CONSTANT_LONG() (frame->function->chunk.constants.values[READ_U24()])
 #define READ_STRING() AS_STRING(READ_CONSTANT())
+#define READ_STRING_LONG() AS_STRING(READ_CONSTANT_LONG())
 #define BINARY_OP(value_type, op)                                                                  \
     do {                                                                                           \
-        if (!IS_NUMBER(virtual_machine_stack_peek(0)) ||                                           \
-            !IS_NUMBER(virtual_machine_stack_peek(1))) {                                           \
-            runtime_error("Operands must be numbers.");                                            \
-            return INTERPRET_RUNTIME_ERROR;                                                        \
+        if (!IS_NUMBER(PEEK(0)) || !IS_NUMBER(PEEK(1))) {                                          \
+            RUNTIME_ERROR("Operands must be numbers.");                                            \
         }                                                                                          \
-        double b = AS_NUMBER(virtual_machine_stack_pop());                                         \
-        double a = AS_NUMBER(virtual_machine_stack_pop());                                         \
-        virtual_machine_stack_push(value_type(a op b));                                            \
+        double b = AS_NUMBER(POP());                                                               \
+        double a = AS_NUMBER(POP());                                                               \
+        PUSH(value_type(a op b));                                                                  \
     } while (false);
+#define COMPARE_JUMP(op)                                                                           \
+    do {                                                                                           \
+        uint16_t offset = READ_SHORT();                                                            \
+        if (!IS_NUMBER(PEEK(0)) || !IS_NUMBER(PEEK(1))) {                                          \
+            RUNTIME_ERROR("Operands must be numbers.");                                            \
+        }                                                                                          \
+        double b = AS_NUMBER(POP());                                                               \
+        double a = AS_NUMBER(POP());                                                               \
+        if (!(a op b)) {                                                                           \
+            ip += offset;                                                                          \
+        }                                                                                          \
+    } while (false)
 
 #ifdef DEBUG_TRACE_EXECUTION
-    printf("== virtual machine ==\n");
-    dump_constant_table(frame);
+#define TRACE_INSTRUCTION()                                                                        \
+    do {                                                                                           \
+        SYNC_STATE();                                                                              \
+        dump_stack();                                                                              \
+        dump_global_variables();                                                                   \
+        disassemble_instruction(&frame->function->chunk, (int)(ip - frame->function->chunk.code)); \
+    } while (false)
+#elif defined(DEBUG_PROFILE_OPCODES)
+#define TRACE_INSTRUCTION() record_opcode(*ip)
+#else
+#define TRACE_INSTRUCTION()                                                                        \
+    do {                                                                                           \
+    } while (false)
+#endif
+
+// Threaded dispatch: each handler jumps straight to the next one through the label table, so the
+// branch predictor gets one indirect branch per opcode instead of a single shared one.
+#ifdef CLOX_USE_COMPUTED_GOTO
+#define VM_DISPATCH()                                                                              \
+    do {                                                                                           \
+        TRACE_INSTRUCTION();                                                                       \
+        goto* dispatch_table[instruction = READ_BYTE()];                                           \
+    } while (false)
+#define VM_CASE(op) label_##op
+#define VM_DEFAULT label_unknown_opcode
+#define VM_BREAK VM_DISPATCH()
+#else
+#define VM_CASE(op) case op
+#define VM_DEFAULT default
+#define VM_BREAK break
 #endif
 
-    while (true) {
 #ifdef DEBUG_TRACE_EXECUTION
-        dump_stack();
-        dump_global_variables();
-        disassemble_instruction(&frame->function->chunk,
-                                (int)(frame->ip - frame->function->chunk.code));
+    printf("== virtual machine ==\n");
+    dump_constant_table(frame);
 #endif
 
-        uint8_t instruction;
+    uint8_t instruction;
+
+#ifdef CLOX_USE_COMPUTED_GOTO
+    // Every byte value gets an entry so that a corrupt opcode still lands on the error handler
+    // instead of jumping through a null pointer.
+    static void* dispatch_table[UINT8_COUNT] = {
+        [0 ... UINT8_MAX] = &&label_unknown_opcode,
+        [OP_CONSTANT] = &&label_OP_CONSTANT,
+        [OP_CONSTANT_LONG] = &&label_OP_CONSTANT_LONG,
+        [OP_NULL] = &&label_OP_NULL,
+        [OP_TRUE] = &&label_OP_TRUE,
+        [OP_FALSE] = &&label_OP_FALSE,
+        [OP_POP] = &&label_OP_POP,
+        [OP_DUP] = &&label_OP_DUP,
+        [OP_GET_LOCAL] = &&label_OP_GET_LOCAL,
+        [OP_SET_LOCAL] = &&label_OP_SET_LOCAL,
+        [OP_GET_LOCAL_0] = &&label_OP_GET_LOCAL_0,
+        [OP_GET_LOCAL_1] = &&label_OP_GET_LOCAL_1,
+        [OP_GET_LOCAL_2] = &&label_OP_GET_LOCAL_2,
+        [OP_GET_LOCAL_3] = &&label_OP_GET_LOCAL_3,
+        [OP_SET_LOCAL_0] = &&label_OP_SET_LOCAL_0,
+        [OP_SET_LOCAL_1] = &&label_OP_SET_LOCAL_1,
+        [OP_SET_LOCAL_2] = &&label_OP_SET_LOCAL_2,
+        [OP_SET_LOCAL_3] = &&label_OP_SET_LOCAL_3,
+        [OP_GET_GLOBAL] = &&label_OP_GET_GLOBAL,
+        [OP_GET_GLOBAL_LONG] = &&label_OP_GET_GLOBAL_LONG,
+        [OP_DEFINE_GLOBAL] = &&label_OP_DEFINE_GLOBAL,
+        [OP_DEFINE_GLOBAL_CONST] = &&label_OP_DEFINE_GLOBAL_CONST,
+        [OP_DEFINE_GLOBAL_LONG] = &&label_OP_DEFINE_GLOBAL_LONG,
+        [OP_DEFINE_GLOBAL_LONG_CONST] = &&label_OP_DEFINE_GLOBAL_LONG_CONST,
+        [OP_SET_GLOBAL] = &&label_OP_SET_GLOBAL,
+        [OP_SET_GLOBAL_LONG] = &&label_OP_SET_GLOBAL_LONG,
+        [OP_GET_UPVALUE] = &&label_OP_GET_UPVALUE,
+        [OP_SET_UPVALUE] = &&label_OP_SET_UPVALUE,
+        [OP_GET_PROPERTY] = &&label_OP_GET_PROPERTY,
+        [OP_SET_PROPERTY] = &&label_OP_SET_PROPERTY,
+        [OP_GET_SUPER] = &&label_OP_GET_SUPER,
+        [OP_GET_SUPER_LONG] = &&label_OP_GET_SUPER_LONG,
+        [OP_INVOKE] = &&label_OP_INVOKE,
+        [OP_SUPER_INVOKE] = &&label_OP_SUPER_INVOKE,
+        [OP_LIST] = &&label_OP_LIST,
+        [OP_GET_INDEX] = &&label_OP_GET_INDEX,
+        [OP_SET_INDEX] = &&label_OP_SET_INDEX,
+        [OP_EQUAL] = &&label_OP_EQUAL,
+        [OP_GREATER] = &&label_OP_GREATER,
+        [OP_LESS] = &&label_OP_LESS,
+        [OP_NOT_EQUAL] = &&label_OP_NOT_EQUAL,
+        [OP_GREATER_EQUAL] = &&label_OP_GREATER_EQUAL,
+        [OP_LESS_EQUAL] = &&label_OP_LESS_EQUAL,
+        [OP_ADD] = &&label_OP_ADD,
+        [OP_SUBTRACT] = &&label_OP_SUBTRACT,
+        [OP_MULTIPLY] = &&label_OP_MULTIPLY,
+        [OP_DIVIDE] = &&label_OP_DIVIDE,
+        [OP_NOT] = &&label_OP_NOT,
+        [OP_NEGATE] = &&label_OP_NEGATE,
+        [OP_JUMP] = &&label_OP_JUMP,
+        [OP_JUMP_LONG] = &&label_OP_JUMP_LONG,
+        [OP_JUMP_IF_FALSE] = &&label_OP_JUMP_IF_FALSE,
+        [OP_JUMP_IF_FALSE_LONG] = &&label_OP_JUMP_IF_FALSE_LONG,
+        [OP_POP_JUMP_IF_FALSE] = &&label_OP_POP_JUMP_IF_FALSE,
+        [OP_LOOP] = &&label_OP_LOOP,
+        [OP_LOOP_LONG] = &&label_OP_LOOP_LONG,
+        [OP_CALL] = &&label_OP_CALL,
+        [OP_TAIL_CALL] = &&label_OP_TAIL_CALL,
+        [OP_RETURN] = &&label_OP_RETURN,
+        [OP_CLOSURE] = &&label_OP_CLOSURE,
+        [OP_CLOSURE_LONG] = &&label_OP_CLOSURE_LONG,
+        [OP_CLOSE_UPVALUE] = &&label_OP_CLOSE_UPVALUE,
+        [OP_CLASS] = &&label_OP_CLASS,
+        [OP_CLASS_LONG] = &&label_OP_CLASS_LONG,
+        [OP_METHOD] = &&label_OP_METHOD,
+        [OP_METHOD_LONG] = &&label_OP_METHOD_LONG,
+        [OP_INHERIT] = &&label_OP_INHERIT,
+        [OP_SWITCH] = &&label_OP_SWITCH,
+        [OP_GET_LOCAL_CONSTANT] = &&label_OP_GET_LOCAL_CONSTANT,
+        [OP_SET_LOCAL_POP] = &&label_OP_SET_LOCAL_POP,
+        [OP_SET_GLOBAL_POP] = &&label_OP_SET_GLOBAL_POP,
+        [OP_EQUAL_JUMP_IF_FALSE] = &&label_OP_EQUAL_JUMP_IF_FALSE,
+        [OP_NOT_EQUAL_JUMP_IF_FALSE] = &&label_OP_NOT_EQUAL_JUMP_IF_FALSE,
+        [OP_GREATER_JUMP_IF_FALSE] = &&label_OP_GREATER_JUMP_IF_FALSE,
+        [OP_LESS_JUMP_IF_FALSE] = &&label_OP_LESS_JUMP_IF_FALSE,
+        [OP_ADD_NUM] = &&label_OP_ADD_NUM,
+        [OP_EQUAL_NUM] = &&label_OP_EQUAL_NUM,
+        [OP_NOT_EQUAL_NUM] = &&label_OP_NOT_EQUAL_NUM,
+        [OP_GET_GLOBAL_DEFINED] = &&label_OP_GET_GLOBAL_DEFINED,
+        [OP_DEBUG] = &&label_OP_DEBUG,
+    };
+
+    VM_DISPATCH();
+#else
+    while (true) {
+        TRACE_INSTRUCTION();
 
         switch (instruction = READ_BYTE()) {
-            case OP_CONSTANT: {
-                clox_value constant = READ_CONSTANT();
-                virtual_machine_stack_push(constant);
-            } break;
-            case OP_CONSTANT_LONG: {
-                int reconstructed_index = READ_U24(frame);
-                virtual_machine_stack_push(
-                    frame->function->chunk.constants.values[reconstructed_index]);
-            } break;
-            case OP_NULL: {
-                virtual_machine_stack_push(NULL_VALUE);
-            } break;
-            case OP_TRUE: {
-                virtual_machine_stack_push(BOOL_VALUE(true));
-            } break;
-            case OP_FALSE: {
-                virtual_machine_stack_push(BOOL_VALUE(false));
-            } break;
-            case OP_POP: {
-                virtual_machine_stack_pop();
-            } break;
-            case OP_DUP: {
-                virtual_machine_stack_push(virtual_machine_stack_peek(0));
-            } break;
-            case OP_GET_LOCAL: {
+#endif
+            VM_CASE(OP_CONSTANT): {
+                PUSH(READ_CONSTANT());
+            } VM_BREAK;
+            VM_CASE(OP_CONSTANT_LONG): {
+                PUSH(READ_CONSTANT_LONG());
+            } VM_BREAK;
+            VM_CASE(OP_NULL): {
+                PUSH(NULL_VALUE);
+            } VM_BREAK;
+            VM_CASE(OP_TRUE): {
+                PUSH(BOOL_VALUE(true));
+            } VM_BREAK;
+            VM_CASE(OP_FALSE): {
+                PUSH(BOOL_VALUE(false));
+            } VM_BREAK;
+            VM_CASE(OP_POP): {
+                --stack_top;
+            } VM_BREAK;
+            VM_CASE(OP_DUP): {
+                clox_value top = PEEK(0);
+                PUSH(top);
+            } VM_BREAK;
+            VM_CASE(OP_GET_LOCAL): {
                 uint8_t slot = READ_BYTE();
-                virtual_machine_stack_push(frame->slots[slot]);
-            } break;
-            case OP_SET_LOCAL: {
+                PUSH(slots[slot]);
+            } VM_BREAK;
+            VM_CASE(OP_SET_LOCAL): {
                 uint8_t slot = READ_BYTE();
-                frame->slots[slot] = virtual_machine_stack_peek(0);
-            } break;
-            case OP_GET_GLOBAL: {
+                slots[slot] = PEEK(0);
+            } VM_BREAK;
+            VM_CASE(OP_GET_LOCAL_0): {
+                PUSH(slots[0]);
+            } VM_BREAK;
+            VM_CASE(OP_GET_LOCAL_1): {
+                PUSH(slots[1]);
+            } VM_BREAK;
+            VM_CASE(OP_GET_LOCAL_2): {
+                PUSH(slots[2]);
+            } VM_BREAK;
+            VM_CASE(OP_GET_LOCAL_3): {
+                PUSH(slots[3]);
+            } VM_BREAK;
+            VM_CASE(OP_SET_LOCAL_0): {
+                slots[0] = PEEK(0);
+            } VM_BREAK;
+            VM_CASE(OP_SET_LOCAL_1): {
+                slots[1] = PEEK(0);
+            } VM_BREAK;
+            VM_CASE(OP_SET_LOCAL_2): {
+                slots[2] = PEEK(0);
+            } VM_BREAK;
+            VM_CASE(OP_SET_LOCAL_3): {
+                slots[3] = PEEK(0);
+            } VM_BREAK;
+            VM_CASE(OP_GET_GLOBAL): {
+                global_variable* global = &vm.globals[READ_BYTE()];
+                if (!global->is_defined) {
+                    RUNTIME_ERROR("Undefined variable '%s'.", global->name->chars);
+                }
+                // Nothing ever undefines a global, so after one successful read the check is dead
+                // weight for this instruction.
+                ip[-2] = OP_GET_GLOBAL_DEFINED;
+                PUSH(global->val);
+            } VM_BREAK;
+            VM_CASE(OP_GET_GLOBAL_LONG): {
+                global_variable* global = &vm.globals[READ_U24()];
+                if (!global->is_defined) {
+                    RUNTIME_ERROR("Undefined variable '%s'.", global->name->chars);
+                }
+                PUSH(global->val);
+            } VM_BREAK;
+            VM_CASE(OP_DEFINE_GLOBAL): {
+                global_variable* global = &vm.globals[READ_BYTE()];
+                global->val = POP();
+                global->is_defined = true;
+            } VM_BREAK;
+            VM_CASE(OP_DEFINE_GLOBAL_CONST): {
+                global_variable* global = &vm.globals[READ_BYTE()];
+                global->val = POP();
+                global->is_defined = true;
+                global->is_const = true;
+            } VM_BREAK;
+            VM_CASE(OP_DEFINE_GLOBAL_LONG): {
+                global_variable* global = &vm.globals[READ_U24()];
+                global->val = POP();
+                global->is_defined = true;
+            } VM_BREAK;
+            VM_CASE(OP_DEFINE_GLOBAL_LONG_CONST): {
+                global_variable* global = &vm.globals[READ_U24()];
+                global->val = POP();
+                global->is_defined = true;
+                global->is_const = true;
+            } VM_BREAK;
+            VM_CASE(OP_SET_GLOBAL): {
+                global_variable* global = &vm.globals[READ_BYTE()];
+                if (global->is_const) {
+                    RUNTIME_ERROR("Cannot reassign to a global variable marked 'const'.");
+                }
+                if (!global->is_defined) {
+                    RUNTIME_ERROR("Undefined variable '%s'.", global->name->chars);
+                }
+                global->val = PEEK(0);
+            } VM_BREAK;
+            VM_CASE(OP_SET_GLOBAL_LONG): {
+                global_variable* global = &vm.globals[READ_U24()];
+                if (global->is_const) {
+                    RUNTIME_ERROR("Cannot reassign to a global variable marked 'const'.");
+                }
+                if (!global->is_defined) {
+                    RUNTIME_ERROR("Undefined variable '%s'.", global->name->chars);
+                }
+                global->val = PEEK(0);
+            } VM_BREAK;
+            VM_CASE(OP_GET_UPVALUE): {
+                PUSH(*frame->closure->upvalues[READ_BYTE()]->location);
+            } VM_BREAK;
+            VM_CASE(OP_SET_UPVALUE): {
+                object_upvalue* upvalue = frame->closure->upvalues[READ_BYTE()];
+                *upvalue->location = PEEK(0);
+                write_barrier((object*)upvalue, PEEK(0));
+            } VM_BREAK;
+            VM_CASE(OP_GET_PROPERTY): {
+                property_cache* cache = &frame->function->chunk.property_caches[READ_SHORT()];
+                if (!IS_INSTANCE(PEEK(0))) {
+                    RUNTIME_ERROR("Only instances have properties.");
+                }
+                object_instance* instance = AS_INSTANCE(PEEK(0));
+                if (cache->entries[0].shape == instance->shape) {
+                    ++vm.inline_caches.monomorphic_hits;
+                    PEEK(0) = instance->fields[cache->entries[0].slot];
+                } else {
+                    SYNC_STATE();
+                    if (!get_property_uncached(cache, instance)) {
+                        return INTERPRET_RUNTIME_ERROR;
+                    }
+                }
+            } VM_BREAK;
+            VM_CASE(OP_SET_PROPERTY): {
+                property_cache* cache = &frame->function->chunk.property_caches[READ_SHORT()];
+                if (!IS_INSTANCE(PEEK(1))) {
+                    RUNTIME_ERROR("Only instances have fields.");
+                }
+                object_instance* instance = AS_INSTANCE(PEEK(1));
+                clox_value val = PEEK(0);
+                property_cache_entry* entry = &cache->entries[0];
+                // A store that adds the field only hits while the array has room for it.
+                if (entry->shape == instance->shape && entry->slot < instance->field_capacity) {
+                    ++vm.inline_caches.monomorphic_hits;
+                    if (entry->transition != NULL) {
+                        instance->shape = entry->transition;
+                        write_barrier((object*)instance, OBJECT_VALUE(entry->transition));
+                    }
+                    instance->fields[entry->slot] = val;
+                    write_barrier((object*)instance, val);
+                } else {
+                    SYNC_STATE();
+                    set_property_uncached(cache, instance, val);
+                }
+                --stack_top;
+                PEEK(0) = val;
+            } VM_BREAK;
+            VM_CASE(OP_GET_SUPER): {
                 object_string* name = READ_STRING();
-                clox_value val;
-                if (!hash_table_get(&vm.global_variables, name, &val)) {
-                    runtime_error("Undefined variable '%s'.", name->chars);
+                object_class* superclass = AS_CLASS(POP());
+                SYNC_STATE();
+                if (!bind_method(superclass, name)) {
                     return INTERPRET_RUNTIME_ERROR;
                 }
-                virtual_machine_stack_push(val);
-            } break;
-            case OP_GET_GLOBAL_LONG: {
-                int reconstructed_index = READ_U24(frame);
-                object_string* name =
-                    AS_STRING(frame->function->chunk.constants.values[reconstructed_index]);
-                clox_value val;
-                if (!hash_table_get(&vm.global_variables, name, &val)) {
-                    runtime_error("Undefined variable '%s'.", name->chars);
+            } VM_BREAK;
+            VM_CASE(OP_GET_SUPER_LONG): {
+                object_string* name = READ_STRING_LONG();
+                object_class* superclass = AS_CLASS(POP());
+                SYNC_STATE();
+                if (!bind_method(superclass, name)) {
                     return INTERPRET_RUNTIME_ERROR;
                 }
-                virtual_machine_stack_push(val);
-            } break;
-            case OP_DEFINE_GLOBAL: {
-                object_string* name = READ_STRING();
-                hash_table_set(&vm.global_variables, name, virtual_machine_stack_peek(0));
-                virtual_machine_stack_pop();
-            } break;
-            case OP_DEFINE_GLOBAL_CONST: {
-                object_string* name = READ_STRING();
-                hash_table_set(&vm.global_variables, name, virtual_machine_stack_peek(0));
-                hash_table_set(&vm.global_consts, name, BOOL_VALUE(true));
-                virtual_machine_stack_pop();
-            } break;
-            case OP_DEFINE_GLOBAL_LONG: {
-                int reconstructed_index = READ_U24(frame);
-                object_string* name =
-                    AS_STRING(frame->function->chunk.constants.values[reconstructed_index]);
-                hash_table_set(&vm.global_variables, name, virtual_machine_stack_peek(0));
-                virtual_machine_stack_pop();
-            } break;
-            case OP_DEFINE_GLOBAL_LONG_CONST: {
-                int reconstructed_index = READ_U24(frame);
-                object_string* name =
-                    AS_STRING(frame->function->chunk.constants.values[reconstructed_index]);
-                hash_table_set(&vm.global_variables, name, virtual_machine_stack_peek(0));
-                hash_table_set(&vm.global_consts, name, BOOL_VALUE(true));
-                virtual_machine_stack_pop();
-            } break;
-            case OP_SET_GLOBAL: {
-                object_string* name = READ_STRING();
-
-                if (hash_table_get(&vm.global_consts, name, &(clox_value){0})) {
-                    runtime_error("Cannot reassign to a global variable marked 'const'.");
+            } VM_BREAK;
+            VM_CASE(OP_INVOKE): {
+                method_cache* cache = &frame->function->chunk.method_caches[READ_SHORT()];
+                int arg_count = READ_BYTE();
+                clox_value receiver = PEEK(arg_count);
+                SYNC_STATE();
+                bool ok;
+                if (IS_INSTANCE(receiver) && AS_INSTANCE(receiver)->shape == cache->shape &&
+                    AS_INSTANCE(receiver)->klass == cache->klass) {
+                    ++vm.inline_caches.method_hits;
+                    ok = call_method(cache->method, arg_count);
+                } else {
+                    ok = invoke_uncached(frame->function, cache, arg_count);
+                }
+                if (!ok) {
                     return INTERPRET_RUNTIME_ERROR;
                 }
-
-                if (hash_table_set(&vm.global_variables, name, virtual_machine_stack_peek(0))) {
-                    hash_table_delete(&vm.global_variables, name);
-                    runtime_error("Undefined variable '%s'.", name->chars);
+                RELOAD_STATE();
+            } VM_BREAK;
+            VM_CASE(OP_SUPER_INVOKE): {
+                method_cache* cache = &frame->function->chunk.method_caches[READ_SHORT()];
+                int arg_count = READ_BYTE();
+                object_class* superclass = AS_CLASS(POP());
+                SYNC_STATE();
+                bool ok;
+                if (cache->klass == superclass) {
+                    ++vm.inline_caches.method_hits;
+                    ok = call_method(cache->method, arg_count);
+                } else {
+                    ok = super_invoke_uncached(frame->function, cache, superclass, arg_count);
+                }
+                if (!ok) {
                     return INTERPRET_RUNTIME_ERROR;
                 }
-            } break;
-            case OP_SET_GLOBAL_LONG: {
-                int reconstructed_index = READ_U24(frame);
-                object_string* name =
-                    AS_STRING(frame->function->chunk.constants.values[reconstructed_index]);
-                if (hash_table_set(&vm.global_variables, name, virtual_machine_stack_peek(0))) {
-                    hash_table_delete(&vm.global_variables, name);
-                    runtime_error("Undefined variable '%s'.", name->chars);
+                RELOAD_STATE();
+            } VM_BREAK;
+            VM_CASE(OP_LIST): {
+                int count = READ_BYTE();
+                SYNC_STATE();
+                object_list* list = new_list(stack_top - count, count);
+                stack_top -= count;
+                PUSH(OBJECT_VALUE(list));
+            } VM_BREAK;
+            VM_CASE(OP_GET_INDEX): {
+                if (!IS_LIST(PEEK(1))) {
+                    RUNTIME_ERROR("Only lists can be indexed.");
+                }
+                int length;
+                clox_value* values = list_values(AS_LIST(PEEK(1)), &length);
+                int slot = list_slot(PEEK(0), length);
+                if (slot < 0) {
+                    SYNC_STATE();
+                    list_index_error(PEEK(0), length);
                     return INTERPRET_RUNTIME_ERROR;
                 }
-            } break;
-            case OP_EQUAL: {
-                clox_value b = virtual_machine_stack_pop();
-                clox_value a = virtual_machine_stack_pop();
-                virtual_machine_stack_push(BOOL_VALUE(values_equal(a, b)));
-            } break;
-            case OP_GREATER: {
+                --stack_top;
+                PEEK(0) = values[slot];
+            } VM_BREAK;
+            VM_CASE(OP_SET_INDEX): {
+                if (!IS_LIST(PEEK(2))) {
+                    RUNTIME_ERROR("Only lists can be indexed.");
+                }
+                object_list* list = AS_LIST(PEEK(2));
+                int length;
+                clox_value* values = list_values(list, &length);
+                int slot = list_slot(PEEK(1), length);
+                if (slot < 0) {
+                    SYNC_STATE();
+                    list_index_error(PEEK(1), length);
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                clox_value val = PEEK(0);
+                values[slot] = val;
+                write_barrier((object*)(list->base != NULL ? list->base : list), val);
+                stack_top -= 2;
+                PEEK(0) = val;
+            } VM_BREAK;
+            VM_CASE(OP_EQUAL): {
+                if (IS_NUMBER(PEEK(0)) && IS_NUMBER(PEEK(1))) {
+                    QUICKEN(OP_EQUAL_NUM);
+                }
+                clox_value b = POP();
+                clox_value a = POP();
+                PUSH(BOOL_VALUE(values_equal(a, b)));
+            } VM_BREAK;
+            VM_CASE(OP_GREATER): {
                 BINARY_OP(BOOL_VALUE, >);
-            } break;
-            case OP_LESS: {
+            } VM_BREAK;
+            VM_CASE(OP_LESS): {
                 BINARY_OP(BOOL_VALUE, <);
-            } break;
-            case OP_ADD: {
-                if (IS_STRING(virtual_machine_stack_peek(0)) &&
-                    IS_STRING(virtual_machine_stack_peek(1))) {
+            } VM_BREAK;
+            // The fused comparisons stand in for OP_EQUAL/OP_LESS/OP_GREATER followed by OP_NOT, so
+            // they negate the opposite test rather than flipping the operator, which keeps NaN
+            // behaving exactly as before.
+            VM_CASE(OP_NOT_EQUAL): {
+                if (IS_NUMBER(PEEK(0)) && IS_NUMBER(PEEK(1))) {
+                    QUICKEN(OP_NOT_EQUAL_NUM);
+                }
+                clox_value b = POP();
+                clox_value a = POP();
+                PUSH(BOOL_VALUE(!values_equal(a, b)));
+            } VM_BREAK;
+            VM_CASE(OP_GREATER_EQUAL): {
+                if (!IS_NUMBER(PEEK(0)) || !IS_NUMBER(PEEK(1))) {
+                    RUNTIME_ERROR("Operands must be numbers.");
+                }
+                double b = AS_NUMBER(POP());
+                double a = AS_NUMBER(POP());
+                PUSH(BOOL_VALUE(!(a < b)));
+            } VM_BREAK;
+            VM_CASE(OP_LESS_EQUAL): {
+                if (!IS_NUMBER(PEEK(0)) || !IS_NUMBER(PEEK(1))) {
+                    RUNTIME_ERROR("Operands must be numbers.");
+                }
+                double b = AS_NUMBER(POP());
+                double a = AS_NUMBER(POP());
+                PUSH(BOOL_VALUE(!(a > b)));
+            } VM_BREAK;
+            VM_CASE(OP_ADD): {
+                if (IS_STRING(PEEK(0)) && IS_STRING(PEEK(1))) {
+                    SYNC_STATE();
                     concatenate_string();
-                } else if (IS_NUMBER(virtual_machine_stack_peek(0)) &&
-                           IS_NUMBER(virtual_machine_stack_peek(1))) {
+                    stack_top = vm.stack_top;
+                } else if (IS_NUMBER(PEEK(0)) && IS_NUMBER(PEEK(1))) {
+                    QUICKEN(OP_ADD_NUM);
                     BINARY_OP(NUMBER_VALUE, +);
                 } else {
-                    runtime_error("Operands must be two numbers or two strings.");
-                    return INTERPRET_RUNTIME_ERROR;
+                    RUNTIME_ERROR("Operands must be two numbers or two strings.");
                 }
-            } break;
-            case OP_SUBTRACT: {
+            } VM_BREAK;
+            VM_CASE(OP_SUBTRACT): {
                 BINARY_OP(NUMBER_VALUE, -);
-            } break;
-            case OP_MULTIPLY: {
+            } VM_BREAK;
+            VM_CASE(OP_MULTIPLY): {
                 BINARY_OP(NUMBER_VALUE, *);
-            } break;
-            case OP_DIVIDE: {
+            } VM_BREAK;
+            VM_CASE(OP_DIVIDE): {
                 BINARY_OP(NUMBER_VALUE, /);
-            } break;
-            case OP_NOT: {
-                virtual_machine_stack_push(BOOL_VALUE(is_falsey(virtual_machine_stack_pop())));
-            } break;
-            case OP_NEGATE: {
-                if (!IS_NUMBER(virtual_machine_stack_peek(0))) {
-                    runtime_error("Operand must be a number");
-                    return INTERPRET_RUNTIME_ERROR;
+            } VM_BREAK;
+            VM_CASE(OP_NOT): {
+                PEEK(0) = BOOL_VALUE(is_falsey(PEEK(0)));
+            } VM_BREAK;
+            VM_CASE(OP_NEGATE): {
+                if (!IS_NUMBER(PEEK(0))) {
+                    RUNTIME_ERROR("Operand must be a number");
                 }
-                virtual_machine_stack_push(NUMBER_VALUE(-AS_NUMBER(virtual_machine_stack_pop())));
-            } break;
-            case OP_JUMP: {
+                PEEK(0) = NUMBER_VALUE(-AS_NUMBER(PEEK(0)));
+            } VM_BREAK;
+            VM_CASE(OP_JUMP): {
                 uint16_t offset = READ_SHORT();
-                frame->ip += offset;
-            } break;
-            case OP_JUMP_IF_FALSE: {
+                ip += offset;
+            } VM_BREAK;
+            VM_CASE(OP_JUMP_LONG): {
+                int offset = READ_U24();
+                ip += offset;
+            } VM_BREAK;
+            VM_CASE(OP_JUMP_IF_FALSE): {
                 uint16_t offset = READ_SHORT();
-                if (is_falsey(virtual_machine_stack_peek(0))) {
-                    frame->ip += offset;
+                if (is_falsey(PEEK(0))) {
+                    ip += offset;
                 }
-            } break;
-            case OP_LOOP: {
+            } VM_BREAK;
+            VM_CASE(OP_JUMP_IF_FALSE_LONG): {
+                int offset = READ_U24();
+                if (is_falsey(PEEK(0))) {
+                    ip += offset;
+                }
+            } VM_BREAK;
+            VM_CASE(OP_POP_JUMP_IF_FALSE): {
                 uint16_t offset = READ_SHORT();
-                frame->ip -= offset;
-            } break;
-            case OP_CALL: {
+                if (is_falsey(POP())) {
+                    ip += offset;
+                }
+            } VM_BREAK;
+            VM_CASE(OP_LOOP): {
+                uint16_t offset = READ_SHORT();
+                ip -= offset;
+            } VM_BREAK;
+            VM_CASE(OP_LOOP_LONG): {
+                int offset = READ_U24();
+                ip -= offset;
+            } VM_BREAK;
+            VM_CASE(OP_CALL): {
                 int arg_count = READ_BYTE();
-                if (!call_value(virtual_machine_stack_peek(arg_count), arg_count)) {
+                clox_value callee = PEEK(arg_count);
+                SYNC_STATE();
+                // Compiled functions are by far the common callee, so they get an inlined path
+                // of their own.
+                bool ok = IS_FUNCTION(callee)
+                              ? call_function(AS_FUNCTION(callee), NULL, arg_count)
+                              : call_value(callee, arg_count);
+                if (!ok) {
                     return INTERPRET_RUNTIME_ERROR;
                 }
-                frame = &vm.frames[vm.frame_count - 1];
-            } break;
-            case OP_RETURN: {
-                clox_value result = virtual_machine_stack_pop();
+                RELOAD_STATE();
+            } VM_BREAK;
+            VM_CASE(OP_TAIL_CALL): {
+                int arg_count = READ_BYTE();
+                clox_value callee = PEEK(arg_count);
+                SYNC_STATE();
+                // Anything but a function or closure is called as usual, its result then goes
+                // through the OP_RETURN that always follows.
+                bool ok;
+                if (IS_FUNCTION(callee)) {
+                    ok = tail_call_function(AS_FUNCTION(callee), NULL, arg_count);
+                } else if (IS_CLOSURE(callee)) {
+                    object_closure* closure = AS_CLOSURE(callee);
+                    ok = tail_call_function(closure->function, closure, arg_count);
+                } else {
+                    ok = call_value(callee, arg_count);
+                }
+                if (!ok) {
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                RELOAD_STATE();
+            } VM_BREAK;
+            VM_CASE(OP_RETURN): {
+                clox_value result = POP();
+                close_upvalues(slots);
                 --vm.frame_count;
                 if (vm.frame_count == 0) {
-                    virtual_machine_stack_pop();
+                    vm.stack_top = stack_top - 1;
                     return INTERPRET_OK;
                 }
 
-                vm.stack_top = frame->slots;
-                virtual_machine_stack_push(result);
-                frame = &vm.frames[vm.frame_count - 1];
-            } break;
-            case OP_DEBUG: {
+                vm.stack_top = slots;
+                RELOAD_STATE();
+                PUSH(result);
+            } VM_BREAK;
+            VM_CASE(OP_CLOSURE): {
+                object_function* function = AS_FUNCTION(READ_CONSTANT());
+                SYNC_STATE();
+                push_closure(frame, function);
+                stack_top = vm.stack_top;
+            } VM_BREAK;
+            VM_CASE(OP_CLOSURE_LONG): {
+                object_function* function = AS_FUNCTION(READ_CONSTANT_LONG());
+                SYNC_STATE();
+                push_closure(frame, function);
+                stack_top = vm.stack_top;
+            } VM_BREAK;
+            VM_CASE(OP_CLOSE_UPVALUE): {
+                close_upvalues(stack_top - 1);
+                --stack_top;
+            } VM_BREAK;
+            VM_CASE(OP_CLASS): {
+                object_string* name = READ_STRING();
+                SYNC_STATE();
+                PUSH(OBJECT_VALUE(new_class(name)));
+            } VM_BREAK;
+            VM_CASE(OP_CLASS_LONG): {
+                object_string* name = READ_STRING_LONG();
+                SYNC_STATE();
+                PUSH(OBJECT_VALUE(new_class(name)));
+            } VM_BREAK;
+            VM_CASE(OP_METHOD): {
+                object_string* name = READ_STRING();
+                SYNC_STATE();
+                hash_table_set(&AS_CLASS(PEEK(1))->methods, name, PEEK(0));
+                --stack_top;
+            } VM_BREAK;
+            VM_CASE(OP_METHOD_LONG): {
+                object_string* name = READ_STRING_LONG();
+                SYNC_STATE();
+                hash_table_set(&AS_CLASS(PEEK(1))->methods, name, PEEK(0));
+                --stack_top;
+            } VM_BREAK;
+            VM_CASE(OP_INHERIT): {
+                if (!IS_CLASS(PEEK(1))) {
+                    RUNTIME_ERROR("Superclass must be a class.");
+                }
+                SYNC_STATE();
+                hash_table_add_all(&AS_CLASS(PEEK(1))->methods, &AS_CLASS(PEEK(0))->methods);
+                --stack_top;
+            } VM_BREAK;
+            VM_CASE(OP_SWITCH): {
+                // The value stays put for the bodies, the end of the switch pops it.
+                bytecode_chunk* chunk = &frame->function->chunk;
+                switch_table* table = &chunk->switch_tables[READ_SHORT()];
+                ip = chunk->code + switch_table_target(table, PEEK(0));
+            } VM_BREAK;
+            VM_CASE(OP_GET_LOCAL_CONSTANT): {
+                uint8_t slot = READ_BYTE();
+                PUSH(slots[slot]);
+                PUSH(READ_CONSTANT());
+            } VM_BREAK;
+            VM_CASE(OP_SET_LOCAL_POP): {
+                uint8_t slot = READ_BYTE();
+                slots[slot] = POP();
+            } VM_BREAK;
+            VM_CASE(OP_SET_GLOBAL_POP): {
+                global_variable* global = &vm.globals[READ_BYTE()];
+                if (global->is_const) {
+                    RUNTIME_ERROR("Cannot reassign to a global variable marked 'const'.");
+                }
+                if (!global->is_defined) {
+                    RUNTIME_ERROR("Undefined variable '%s'.", global->name->chars);
+                }
+                global->val = POP();
+            } VM_BREAK;
+            VM_CASE(OP_EQUAL_JUMP_IF_FALSE): {
+                uint16_t offset = READ_SHORT();
+                clox_value b = POP();
+                clox_value a = POP();
+                if (!values_equal(a, b)) {
+                    ip += offset;
+                }
+            } VM_BREAK;
+            VM_CASE(OP_NOT_EQUAL_JUMP_IF_FALSE): {
+                uint16_t offset = READ_SHORT();
+                clox_value b = POP();
+                clox_value a = POP();
+                if (values_equal(a, b)) {
+                    ip += offset;
+                }
+            } VM_BREAK;
+            VM_CASE(OP_GREATER_JUMP_IF_FALSE): {
+                COMPARE_JUMP(>);
+            } VM_BREAK;
+            VM_CASE(OP_LESS_JUMP_IF_FALSE): {
+                COMPARE_JUMP(<);
+            } VM_BREAK;
+            VM_CASE(OP_ADD_NUM): {
+                if (!IS_NUMBER(PEEK(0)) || !IS_NUMBER(PEEK(1))) {
+                    DEOPTIMIZE(OP_ADD);
+                    VM_BREAK;
+                }
+                double b = AS_NUMBER(POP());
+                PEEK(0) = NUMBER_VALUE(AS_NUMBER(PEEK(0)) + b);
+            } VM_BREAK;
+            VM_CASE(OP_EQUAL_NUM): {
+                if (!IS_NUMBER(PEEK(0)) || !IS_NUMBER(PEEK(1))) {
+                    DEOPTIMIZE(OP_EQUAL);
+                    VM_BREAK;
+                }
+                double b = AS_NUMBER(POP());
+                PEEK(0) = BOOL_VALUE(AS_NUMBER(PEEK(0)) == b);
+            } VM_BREAK;
+            VM_CASE(OP_NOT_EQUAL_NUM): {
+                if (!IS_NUMBER(PEEK(0)) || !IS_NUMBER(PEEK(1))) {
+                    DEOPTIMIZE(OP_NOT_EQUAL);
+                    VM_BREAK;
+                }
+                double b = AS_NUMBER(POP());
+                PEEK(0) = BOOL_VALUE(AS_NUMBER(PEEK(0)) != b);
+            } VM_BREAK;
+            VM_CASE(OP_GET_GLOBAL_DEFINED): {
+                PUSH(vm.globals[READ_BYTE()].val);
+            } VM_BREAK;
+            VM_CASE(OP_DEBUG): {
+                SYNC_STATE();
                 virtual_machine_debug(frame);
                 return INTERPRET_OK;
-            } break;
-            default: {
+            } VM_BREAK;
+            VM_DEFAULT: {
                 printf("Unknown opcode %d\n", instruction);
                 return INTERPRET_RUNTIME_ERROR;
-            } break;
+            }
+#ifndef CLOX_USE_COMPUTED_GOTO
         }
     }
+#endif
 
+#undef SYNC_STATE
+#undef RELOAD_STATE
+#undef RUNTIME_ERROR
+#undef PUSH
+#undef POP
+#undef PEEK
 #undef READ_BYTE
 #undef READ_SHORT
+#undef READ_U24
+#undef QUICKEN
+#undef DEOPTIMIZE
 #undef READ_CONSTANT
-#undef READ_STRING
+#undef READ_CONSTANT_LONG
 #undef BINARY_OP
+#undef COMPARE_JUMP
+#undef TRACE_INSTRUCTION
+#undef VM_DISPATCH
+#undef VM_CASE
+#undef VM_DEFAULT
+#undef VM_BREAK
 }
 
+#ifdef CLOX_USE_COMPUTED_GOTO
+#pragma GCC diagnostic pop
+#endif
+
 interpret_result virtual_machine_interpret(const char* source_code) {
     object_function* function = compile(source_code);
     if (function == NULL) {
@@ -481,7 +1474,7 @@ interpret_result virtual_machine_interpret(const char* source_code) {
     }
 
     virtual_machine_stack_push(OBJECT_VALUE(function));
-    call_function(function, 0);
+    call_function(function, NULL, 0);
 
     interpret_result result = virtual_machine_run();
     return result;
@@ -1,28 +1,90 @@
 #ifndef JUMI_CLOX_VIRTUAL_MACHINE_H
 #define JUMI_CLOX_VIRTUAL_MACHINE_H
+#include "clox_object.h"
 #include "clox_value.h"
 #include "hash_table.h"
 
-#define STACK_MAX 256
-#define FRAMES_MAX 64
+// Both stacks start out small and grow on demand.  FRAMES_MAX only exists to turn runaway
+// recursion into a runtime error rather than an out of memory one.
+#define STACK_INITIAL 256
+#define FRAMES_INITIAL 64
+#define FRAMES_MAX 65536
+
+// Free values kept above every frame's max_stack, for what gets pushed outside of compiled code:
+// native results, string concatenation and temporaries protected from the GC.
+#define STACK_RESERVE 8
 
 typedef struct {
     object_function* function;
+    // The closure being run, or NULL when the function captures nothing and was called bare.
+    object_closure* closure;
     uint8_t* ip;
     clox_value* slots;
 } call_frame;
 
+// Globals are resolved to a slot index by the compiler, so the VM never hashes a name at runtime.
+// A slot exists as soon as any chunk mentions the name; it only becomes readable once the
+// 'var' declaration that defines it has executed, which keeps globals late bound.
+typedef struct {
+    object_string* name;
+    clox_value val;
+    bool is_defined;
+    bool is_const;
+} global_variable;
+
+// What became of every property access and method call, for 'debug;'.  A hit on the first entry
+// of a property cache is monomorphic, on any other one polymorphic.  A miss fills in a new entry,
+// and an access whose cache is already full is megamorphic and looked up by name.  Method caches
+// hold a single entry, which a miss replaces.
+typedef struct {
+    uint64_t monomorphic_hits;
+    uint64_t polymorphic_hits;
+    uint64_t misses;
+    uint64_t megamorphic;
+    uint64_t method_hits;
+    uint64_t method_misses;
+} inline_cache_stats;
+
 typedef struct {
-    call_frame frames[FRAMES_MAX];
+    call_frame* frames;
     int frame_count;
+    int frame_capacity;
 
-    clox_value stack[STACK_MAX];
+    clox_value* stack;
     clox_value* stack_top;
-    hash_table global_variables;
-    hash_table global_consts;
+    int stack_capacity;
+    object_upvalue* open_upvalues;
+    global_variable* globals;
+    int global_count;
+    int global_capacity;
+    hash_table global_names;
     hash_table interned_strings;
+    object_string* init_string;
+    // Every instance starts out with this shape, and every other shape is reachable from it.
+    object_shape* empty_shape;
     object* objects;
 
+    size_t bytes_allocated;
+    size_t next_gc;
+    int gray_count;
+    int gray_capacity;
+    object** gray_stack;
+    gc_stats gc;
+    inline_cache_stats inline_caches;
+
+#ifdef CLOX_GC_GENERATIONAL
+    // vm.objects is the nursery; survivors of a minor collection move to old_objects.  While a
+    // major cycle sweeps, the old generation being swept is parked in sweep_objects.
+    object* old_objects;
+    object* sweep_objects;
+    gc_phase gc_phase;
+    bool gc_minor;
+    size_t bytes_since_minor;
+    int remembered_count;
+    int remembered_capacity;
+    object** remembered;
+#endif
+
     bool native_failed;
     char native_error_msg[256];
 } virtual_machine;
@@ -38,6 +100,7 @@ extern virtual_machine vm;
 void virtual_machine_native_errorf(const char* format, ...);
 void virtual_machine_register_native(const char* name, native_fn function, int min_arity,
                                      int max_arity);
+int virtual_machine_global_slot(object_string* name);
 void init_virtual_machine(void);
 void free_virtual_machine(void);
 void virtual_machine_stack_push(clox_value val);